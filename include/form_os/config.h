@@ -6,4 +6,40 @@
 #define OS_VERSION OS_NAME " " OS_RELEASE " (" OS_CONFIG ")"
 
 #define KERNEL_VIRT_BASE    0xF0000000
-#define PAGE_SIZE           4096
+// MMU page size: 12 for 4KiB pages, 13 for 8KiB pages. The page table
+// geometry in arch/pgtable.h follows from it. Can be set from the command
+// line, e.g. CPPFLAGS=-DCONFIG_PAGE_SHIFT=13.
+#ifndef CONFIG_PAGE_SHIFT
+#define CONFIG_PAGE_SHIFT   12
+#endif
+#define PAGE_SIZE           (1 << CONFIG_PAGE_SHIFT)
+
+// Cache RAM copy-back rather than write-through. Stores then stay in the
+// data cache, so whatever the MMU, the instruction cache or a device reads
+// from memory has to be pushed first, see the cache helpers in arch/klib.h.
+#ifndef CONFIG_CACHE_COPYBACK
+#define CONFIG_CACHE_COPYBACK   1
+#endif
+
+// Cache maintenance by range works line by line up to this many 16-byte
+// lines, then 4 KiB page by page. A page operation costs about as much as
+// one on the whole 4 KiB cache, so past CONFIG_CACHE_PAGES_MAX pages the
+// whole cache goes.
+#define CONFIG_CACHE_LINES_MAX  64
+#define CONFIG_CACHE_PAGES_MAX  2
+
+// Run the memory management microbenchmarks during boot
+#define CONFIG_MM_BENCH     0
+
+// Pages kept cleared for `pmm_alloc_zeroed_page`, refilled while idle
+#define CONFIG_ZERO_POOL_PAGES  8
+
+// Empty page table pool pages kept per table size once idle
+#define CONFIG_PT_POOL_EMPTY_PAGES  2
+
+// Range flushes longer than this many pages drop every ATC entry of the
+// address space instead, one PFLUSH per page stops paying off around there
+#define CONFIG_VM_FLUSH_PAGES_MAX   16
+
+// Regions (ranges with their own protection and backing) per address space
+#define CONFIG_VM_SPACE_REGIONS     16
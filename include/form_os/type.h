@@ -22,3 +22,16 @@ struct vir_cp_req {
     struct virt_addr dst;
     phys_bytes count;
 };
+
+// Physical memory statistics, see `pmm_get_stats()`. Counts are in pages.
+#define PMM_RUN_BUCKETS 12
+struct pmm_stats {
+    uint32_t page_size;
+    uint32_t total_pages;       // RAM pages the PMM manages
+    uint32_t free_pages;
+    uint32_t used_pages;
+    uint32_t largest_free_run;  // longest stretch of contiguous free pages
+    uint32_t free_runs;         // number of contiguous free stretches
+    uint32_t run_hist[PMM_RUN_BUCKETS]; // [k]: runs of 2^k..2^(k+1)-1 pages,
+                                        // the last bucket takes everything longer
+};
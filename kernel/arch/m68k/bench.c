@@ -0,0 +1,59 @@
+#include <stdint.h>
+
+#include "arch/bench.h"
+#include "arch/uart68681.h"
+
+// The DUART counter/timer counts X1/16 down from 0xFFFF and wraps around, which
+// gives a 16-bit clock that overflows every ~284ms. bench_clock_ticks() widens
+// it to 32 bits, so it only needs to be sampled more often than that.
+
+#define BENCH_HZ        (DUART_X1_HZ / 16u)
+#define BENCH_NS_PER_TICK (1000000000u / BENCH_HZ)
+
+static uint16_t last_count;
+static uint32_t elapsed;
+
+static uint16_t bench_read_counter(void)
+{
+    uint8_t hi, lo;
+
+    // The two halves are read separately, retry if the upper one moved
+    do {
+        hi = uart->cur;
+        lo = uart->clr;
+    } while (hi != uart->cur);
+
+    return (uint16_t)((hi << 8) | lo);
+}
+
+void bench_clock_start(void)
+{
+    uart->acr  = DUART_ACR_BRG | ACR_CT_COUNTER_X1_16;
+    uart->ctur = 0xFF;
+    uart->ctlr = 0xFF;
+    (void)uart->cnt_start; // a read issues the start command
+
+    last_count = bench_read_counter();
+    elapsed = 0;
+}
+
+uint32_t bench_clock_ticks(void)
+{
+    const uint16_t now = bench_read_counter();
+
+    // Counting down, so this is right across a wrap too
+    elapsed += (uint16_t)(last_count - now);
+    last_count = now;
+    return elapsed;
+}
+
+uint32_t bench_ns_per_op(uint32_t ticks, uint32_t ops)
+{
+    if (ops == 0) {
+        return 0;
+    }
+    if (ticks < UINT32_MAX / BENCH_NS_PER_TICK) {
+        return (ticks * BENCH_NS_PER_TICK) / ops;
+    }
+    return (ticks / ops) * BENCH_NS_PER_TICK;
+}
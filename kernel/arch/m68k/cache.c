@@ -0,0 +1,101 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <form_os/config.h>
+#include <form_os/type.h>
+
+#include "arch/cache.h"
+#include "arch/klib.h"
+
+/* ------------------------- Cache maintenance ------------------------------ */
+
+// Line operations are cheap but go one 16-byte line at a time. A page
+// operation looks at every line the cache could hold for a 4 KiB page, and
+// a whole-cache one at every line in the cache, which holds 4 KiB.
+
+#define CACHE_LINE  16u
+#define CACHE_PAGE  4096u
+
+typedef enum {
+    CACHE_OP_LINES,
+    CACHE_OP_PAGES,
+    CACHE_OP_ALL,
+} cache_op_t;
+
+static cache_op_t cache_op_for(phys_bytes pa, size_t len)
+{
+    const phys_bytes end = pa + (phys_bytes)len;
+    const uint32_t lines = ((end + CACHE_LINE - 1) / CACHE_LINE) - pa / CACHE_LINE;
+    if (lines <= CONFIG_CACHE_LINES_MAX) {
+        return CACHE_OP_LINES;
+    }
+    const uint32_t pages = ((end + CACHE_PAGE - 1) / CACHE_PAGE) - pa / CACHE_PAGE;
+    return pages <= CONFIG_CACHE_PAGES_MAX ? CACHE_OP_PAGES : CACHE_OP_ALL;
+}
+
+void cache_flush_range(phys_bytes pa, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    switch (cache_op_for(pa, len)) {
+    case CACHE_OP_LINES: cache_push_lines(pa, len); break;
+    case CACHE_OP_PAGES: cache_push_pages(pa, len); break;
+    case CACHE_OP_ALL:   cache_push_data();         break;
+    }
+}
+
+void cache_inval_range(phys_bytes pa, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+
+    // Partial lines at the ends hold someone else's data too
+    phys_bytes end = pa + (phys_bytes)len;
+    if (pa % CACHE_LINE != 0) {
+        cache_push_lines(pa, 1);
+        pa += CACHE_LINE - pa % CACHE_LINE;
+    }
+    if (end % CACHE_LINE != 0 && end > pa) {
+        cache_push_lines(end, 1);
+        end -= end % CACHE_LINE;
+    }
+    if (end <= pa) {
+        return;
+    }
+
+    switch (cache_op_for(pa, end - pa)) {
+    case CACHE_OP_LINES:
+        cache_inval_lines(pa, end - pa);
+        break;
+    case CACHE_OP_PAGES: {
+        // Whole pages at once, the lines of partial ones one by one
+        const phys_bytes first = (pa + CACHE_PAGE - 1) & ~(CACHE_PAGE - 1);
+        const phys_bytes last = end & ~(CACHE_PAGE - 1);
+        if (first >= last) {
+            cache_inval_lines(pa, end - pa);
+            break;
+        }
+        cache_inval_lines(pa, first - pa);
+        cache_inval_pages(first, last - first);
+        cache_inval_lines(last, end - last);
+        break;
+    }
+    case CACHE_OP_ALL:
+        cache_push_data();
+        break;
+    }
+}
+
+void icache_sync_range(phys_bytes pa, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    switch (cache_op_for(pa, len)) {
+    case CACHE_OP_LINES: cache_sync_lines(pa, len); break;
+    case CACHE_OP_PAGES: cache_sync_pages(pa, len); break;
+    case CACHE_OP_ALL:   cache_sync_all();          break;
+    }
+}
@@ -6,10 +6,13 @@ are converted to signals. Exceptions in a kernel task cause a panic.
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <form_os/config.h>
 #include <form_os/type.h>
 
+#include "kernel/mm.h"
 #include "kernel/printk.h"
 #include "arch/exception.h"
+#include "arch/pgtable.h"
 
 typedef enum {
     K_SIG_NONE = 0,
@@ -266,9 +269,148 @@ static void panic_kernel_exception(uint8_t vec, saved_regs_t *r, exc_frame_heade
 #define SET_DFC(x) \
     __asm__ __volatile__ (" movec %0,%/dfc" : : "d" (x))
 
+#define GET_DFC(x) \
+    __asm__ __volatile__ (" movec %/dfc,%0" : "=d" (x))
+
 #define GET_BYTE(addr,value) \
     __asm__ __volatile__ (" moves.b %1@, %0": "=d"(value) : "a"(addr))
 
+/* --- access faults --- */
+
+// Special status word of the format 7 frame
+#define SSW_MA          (1u << 11)      // misaligned, crosses into the next page
+#define SSW_ATC         (1u << 10)      // MMU fault, not a bus error
+#define SSW_LK          (1u <<  9)
+#define SSW_RW          (1u <<  8)      // read
+#define SSW_TT(ssw)     (((ssw) >> 3) & 0x3u)
+#define SSW_TM(ssw)     ((ssw) & 0x7u)
+
+#define TT_NORMAL       0u
+#define TT_MOVE16       1u
+#define TT_ALTERNATE    2u
+
+#define TM_USER_DATA    1u
+#define TM_USER_CODE    2u
+
+// Writeback status words, WB1S..WB3S
+#define WBS_VALID       0x80u
+#define WBS_SIZE(wbs)   (((wbs) >> 5) & 0x3u)
+#define WBS_TT(wbs)     (((wbs) >> 3) & 0x3u)
+#define WBS_TM(wbs)     ((wbs) & 0x7u)
+
+#define SIZE_LONG       0u
+#define SIZE_BYTE       1u
+#define SIZE_WORD       2u
+#define SIZE_LINE       3u      // a cache push, WB1 only
+
+static bool fault_in(virt_bytes va, bool write)
+{
+    vm_space_t *vm = vm_space_current();
+    return vm != NULL && vm_space_fault(vm, va, write);
+}
+
+// Finish a write the 040 left pending in the frame, with the function code
+// it was issued with. Returns false if its page can't be made writable.
+static bool do_writeback(uint16_t wbs, uint32_t addr, uint32_t data)
+{
+    if ((wbs & WBS_VALID) == 0) {
+        return true;
+    }
+    if (WBS_TT(wbs) == TT_MOVE16) {
+        LOG_W("MOVE16 writeback to %08lx not supported\n", addr);
+        return false;
+    }
+
+    const unsigned size = WBS_SIZE(wbs);
+    if (size == SIZE_LINE) {
+        LOG_W("Line writeback to %08lx outside WB1\n", addr);
+        return false;
+    }
+    const uint32_t last = addr + (size == SIZE_BYTE ? 0 : size == SIZE_WORD ? 1 : 3);
+    if (WBS_TM(wbs) == TM_USER_DATA && (!fault_in(addr, true) || !fault_in(last, true))) {
+        return false;
+    }
+
+    SET_DFC(WBS_TM(wbs));
+    switch (size) {
+        case SIZE_BYTE:
+            __asm__ __volatile__ (" moves.b %0,%1@" : : "d"(data), "a"(addr) : "memory");
+            break;
+        case SIZE_WORD:
+            __asm__ __volatile__ (" moves.w %0,%1@" : : "d"(data), "a"(addr) : "memory");
+            break;
+        case SIZE_LONG:
+            __asm__ __volatile__ (" moves.l %0,%1@" : : "d"(data), "a"(addr) : "memory");
+            break;
+    }
+    return true;
+}
+
+// WB1 holds either a write like WB2 and WB3 or, with a line size, a cache
+// line that was being pushed: PD0..PD3 at the physical address in WB1A.
+// The line is stored back whole through the kernel's mapping, which puts it
+// back in the cache to be pushed again later.
+static bool do_writeback1(const exc_fmt7_t *e)
+{
+    if ((e->wb1s & WBS_VALID) == 0 || WBS_SIZE(e->wb1s) != SIZE_LINE) {
+        return do_writeback(e->wb1s, e->wb1a, e->wb1d_pd0);
+    }
+
+    volatile uint32_t *line = (volatile uint32_t *)phys_to_virt(e->wb1a & ~0xFu);
+    line[0] = e->wb1d_pd0;
+    line[1] = e->pd1;
+    line[2] = e->pd2;
+    line[3] = e->pd3;
+    return true;
+}
+
+/*
+Resolve an MMU fault on a user address, from user mode or from a MOVES in the
+kernel, by faulting the page into the current space. Returns true when the
+faulting instruction can go on.
+
+Reads are restarted by the RTE. Writes are not: the instruction has already
+completed and the faulted write sits in WB3 or WB2, while WB1 may hold a cache
+push. All of them are done here, WB3 first and WB1 last, as the 040 would
+have issued them.
+*/
+static bool resolve_access_fault(exc_fmt7_t *e)
+{
+    const uint16_t ssw = e->ssw;
+
+    if ((ssw & SSW_ATC) == 0 || SSW_TT(ssw) == TT_MOVE16) {
+        return false;
+    }
+    if (SSW_TM(ssw) != TM_USER_DATA && SSW_TM(ssw) != TM_USER_CODE) {
+        return false;
+    }
+
+    uint32_t addr = e->fa;
+    if (ssw & SSW_MA) {
+        addr = (addr + (PAGE_SIZE - 1)) & PAGE_ADDR_MASK;
+    }
+    // Read-modify-write cycles fault with RW set
+    const bool write = (ssw & SSW_RW) == 0 || (ssw & SSW_LK) != 0;
+    if (!fault_in(addr, write)) {
+        return false;
+    }
+
+    return do_writeback(e->wb3s, e->wb3a, e->wb3d)
+        && do_writeback(e->wb2s, e->wb2a, e->wb2d)
+        && do_writeback1(e);
+}
+
+// The writebacks load DFC with their own function code. A kernel MOVES
+// sequence that faulted goes on with the DFC it had.
+static bool handle_access_fault(exc_frame_header_t *f)
+{
+    uint32_t dfc;
+    GET_DFC(dfc);
+    const bool resolved = resolve_access_fault(exc_as_fmt7(f));
+    SET_DFC(dfc);
+    return resolved;
+}
+
 void syscall_dispatch(saved_regs_t *r, exc_frame_header_t *f)
 {
     (void)f;
@@ -323,6 +465,11 @@ void ExceptionHandler_c(saved_regs_t *r)
         return;
     }
 
+    // First touch of a demand-paged page
+    if (f->fmtvec == FMTVEC(7, 2) && handle_access_fault(f)) {
+        return;
+    }
+
     if (exc_from_user(f)) {
         deliver_exception_to_user(vec, r, f);
         // not reached if we kill the process properly
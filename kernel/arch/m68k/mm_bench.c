@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <form_os/config.h>
+#include <form_os/type.h>
+
+#include "kernel/mm.h"
+#include "kernel/printk.h"
+#include "arch/bench.h"
+#include "arch/mm.h"
+#include "arch/mm_bench.h"
+#include "arch/pgtable.h"
+#include "arch/vm.h"
+
+#if CONFIG_MM_BENCH
+
+#define BENCH_OPS   256
+
+static phys_bytes bench_pages[BENCH_OPS];
+
+/* --- page chains --- */
+
+// Pages held to reach an occupancy level are chained through their first
+// word, which needs no memory besides the pages themselves.
+
+static inline phys_bytes *chain_link(phys_bytes pa)
+{
+    return (phys_bytes*)(uintptr_t)phys_to_virt(pa);
+}
+
+static phys_bytes chain_push(phys_bytes head, phys_bytes pa)
+{
+    *chain_link(pa) = head;
+    return pa;
+}
+
+static void chain_free(phys_bytes head)
+{
+    while (head != PMM_INVALID_PA) {
+        phys_bytes next = *chain_link(head);
+        pmm_free_page(head);
+        head = next;
+    }
+}
+
+/* --- pmm_alloc_page / pmm_free_page --- */
+
+static void pmm_bench_occupancy(uint32_t total, uint32_t percent)
+{
+    // Take every free page, then give back the most recently allocated ones
+    // until `percent` of memory is in use. What's left free is one run of
+    // pages next to a densely used region.
+    phys_bytes held = PMM_INVALID_PA;
+    uint32_t nheld = 0;
+    for (phys_bytes pa; (pa = pmm_alloc_page()) != PMM_INVALID_PA; nheld++) {
+        held = chain_push(held, pa);
+    }
+
+    const uint32_t keep = (total * percent) / 100u;
+    while (nheld > keep && held != PMM_INVALID_PA) {
+        phys_bytes next = *chain_link(held);
+        pmm_free_page(held);
+        held = next;
+        nheld--;
+    }
+
+    // Near full, fewer pages than BENCH_OPS are left. Failed allocations
+    // would be timed too, so only ask for what's there.
+    const uint32_t nfree = total > nheld ? total - nheld : 0;
+    const uint32_t ops = nfree < BENCH_OPS ? nfree : BENCH_OPS;
+
+    uint32_t n = 0;
+    bench_clock_start();
+    for (uint32_t i = 0; i < ops; i++) {
+        const phys_bytes pa = pmm_alloc_page();
+        if (pa != PMM_INVALID_PA) {
+            bench_pages[n++] = pa;
+        }
+    }
+    const uint32_t t_alloc = bench_clock_ticks();
+
+    bench_clock_start();
+    for (uint32_t i = 0; i < n; i++) {
+        pmm_free_page(bench_pages[i]);
+    }
+    const uint32_t t_free = bench_clock_ticks();
+
+    if (n == 0) {
+        LOG("%3lu%% used: no free pages to time\n", percent);
+    } else {
+        LOG("%3lu%% used: alloc %6lu ns/op  free %6lu ns/op  (%lu ops)\n",
+            percent,
+            bench_ns_per_op(t_alloc, n),
+            bench_ns_per_op(t_free, n),
+            n);
+    }
+
+    chain_free(held);
+}
+
+void pmm_bench(void)
+{
+    // Count what's free without touching PMM internals
+    phys_bytes held = PMM_INVALID_PA;
+    uint32_t total = 0;
+    for (phys_bytes pa; (pa = pmm_alloc_page()) != PMM_INVALID_PA; total++) {
+        held = chain_push(held, pa);
+    }
+    chain_free(held);
+
+    LOG("%lu free pages, %u ops per sample\n", total, BENCH_OPS);
+    pmm_bench_occupancy(total, 10);
+    pmm_bench_occupancy(total, 50);
+    pmm_bench_occupancy(total, 95);
+}
+
+/* --- stores to RAM --- */
+
+// Long stores to a buffer that fits the 4 KiB data cache and to one that
+// doesn't. Build with CONFIG_CACHE_COPYBACK 0 and 1 to compare the modes.
+#define STORE_ORDER     4u              // 16 pages
+#define STORE_HOT       2048u           // bytes
+#define STORE_BYTES     (256u << 10)    // per sample, enough for the clock
+
+static uint32_t store_ticks(volatile uint32_t *buf, uint32_t bytes)
+{
+    bench_clock_start();
+    for (uint32_t pass = 0; pass < STORE_BYTES / bytes; pass++) {
+        for (uint32_t i = 0; i < bytes / sizeof(uint32_t); i++) {
+            buf[i] = i ^ pass;
+        }
+    }
+    return bench_clock_ticks();
+}
+
+void cache_bench(void)
+{
+    const phys_bytes pa = pmm_alloc_pages(STORE_ORDER);
+    if (pa == PMM_INVALID_PA) {
+        return;
+    }
+    volatile uint32_t *buf = (volatile uint32_t*)(uintptr_t)phys_to_virt(pa);
+
+    const uint32_t sizes[] = { STORE_HOT, PAGE_SIZE << STORE_ORDER };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        const uint32_t ticks = store_ticks(buf, sizes[s]);
+        LOG("%s stores, %5lu KiB buffer: %6lu ns/KiB\n",
+            CONFIG_CACHE_COPYBACK ? "copy-back" : "write-through",
+            sizes[s] / 1024, bench_ns_per_op(ticks, STORE_BYTES / 1024));
+    }
+
+    pmm_free_pages(pa, STORE_ORDER);
+}
+
+/* --- vm_space_lookup / vm_space_lookup_mmu --- */
+
+// A few pages the ATC keeps, and an address with no pointer table under it
+// where the walk stops at the root
+#define LOOKUP_PAGES    16u
+#define LOOKUP_BASE     0x10000000u
+#define LOOKUP_HOLE     0x20000000u
+
+static uint32_t lookup_ticks(const vm_space_t *vm, bool mmu, virt_bytes base, uint32_t npages)
+{
+    phys_bytes pa;
+    uint32_t flags;
+    bench_clock_start();
+    for (uint32_t i = 0; i < BENCH_OPS; i++) {
+        const virt_bytes va = base + (i % npages) * PAGE_SIZE;
+        if (mmu) {
+            (void)vm_space_lookup_mmu(vm, va, &pa, &flags);
+        } else {
+            (void)vm_space_lookup(vm, va, &pa, &flags);
+        }
+    }
+    return bench_clock_ticks();
+}
+
+void vm_lookup_bench(void)
+{
+    const phys_bytes frame = pmm_alloc_page();
+    if (frame == PMM_INVALID_PA) {
+        return;
+    }
+
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+    for (uint32_t i = 0; i < LOOKUP_PAGES; i++) {
+        vm_space_map_page(&vm, LOOKUP_BASE + i * PAGE_SIZE, frame, USER_PTE_FLAGS);
+    }
+    vm_space_activate(&vm);
+
+    static const struct {
+        const char *what;
+        virt_bytes base;
+        uint32_t npages;
+    } cases[] = {
+        { "mapped  ", LOOKUP_BASE, LOOKUP_PAGES },
+        { "unmapped", LOOKUP_HOLE, 1 },
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        const uint32_t t_walk = lookup_ticks(&vm, false, cases[c].base, cases[c].npages);
+        const uint32_t t_mmu = lookup_ticks(&vm, true, cases[c].base, cases[c].npages);
+        LOG("lookup %s: walk %6lu ns/op  ptestr %6lu ns/op\n", cases[c].what,
+            bench_ns_per_op(t_walk, BENCH_OPS),
+            bench_ns_per_op(t_mmu, BENCH_OPS));
+    }
+
+    vm_space_destroy(&vm);
+    pmm_free_page(frame);
+}
+
+#endif /* CONFIG_MM_BENCH */
@@ -4,23 +4,11 @@
 #include "kernel/mm.h"
 #include "kernel/printk.h"
 #include "arch/head.h"
+#include "arch/pgtable.h"
 
 enum {
-    PAGE_SHIFT      = 12,
-    PAGE_SIZE       = 1u << PAGE_SHIFT,
-
-    ROOT_BITS       = 7,
-    PTR_BITS        = 7,
-    PAGE_BITS       = 6,
-
-    ROOT_ENTRIES    = 1u << ROOT_BITS,
-    PTR_ENTRIES     = 1u << PTR_BITS,
-    PAGE_ENTRIES    = 1u << PAGE_BITS,
-};
-
-enum {
-    ROOT_COVERAGE = PAGE_SIZE << (PTR_BITS + PAGE_BITS),
-    PTR_COVERAGE  = PAGE_SIZE << PAGE_BITS,
+    ROOT_COVERAGE = 1u << ROOT_INDEX_SHIFT,
+    PTR_COVERAGE  = 1u << PTR_INDEX_SHIFT,
     PAGE_COVERAGE = PAGE_SIZE
 };
 
@@ -51,9 +39,9 @@ static inline uint32_t desc_attrs_key(uint32_t desc)
 static inline int root_desc_valid(uint32_t d) { return (d & (1u << 1)) != 0; }
 static inline int ptr_desc_valid (uint32_t d) { return (d & (1u << 1)) != 0; }
 static inline int page_desc_valid(uint32_t d) { return (d & (1u << 0)) != 0; }
-static inline uintptr_t root_table_base(uint32_t d) { return (uintptr_t)phys_to_virt(d & 0xFFFFFE00u); }
-static inline uintptr_t ptr_table_base (uint32_t d) { return (uintptr_t)phys_to_virt(d & 0xFFFFFF00u); }
-static inline uint32_t page_phys_base(uint32_t d) { return d & 0xFFFFF000u; }
+static inline uintptr_t root_table_base(uint32_t d) { return (uintptr_t)phys_to_virt(d & RPTABLE_ADDR_MASK); }
+static inline uintptr_t ptr_table_base (uint32_t d) { return (uintptr_t)phys_to_virt(d & PGTABLE_ADDR_MASK); }
+static inline uint32_t page_phys_base(uint32_t d) { return d & PAGE_ADDR_MASK; }
 
 // Range coalescing
 typedef enum {
@@ -0,0 +1,855 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <form_os/config.h>
+#include <form_os/type.h>
+
+#include "kernel/early_alloc.h"
+#include "kernel/format.h"
+#include "kernel/mm.h"
+#include "kernel/printk.h"
+#include "arch/head.h"
+#include "arch/klib.h"
+#include "arch/mm.h"
+
+#define ARRAY_LEN(x) (sizeof(x) / sizeof((x)[0]))
+
+/* ------------------- Physical memory management --------------------------- */
+
+// Bitfield
+// 0 is allocated, 1 is free
+// Page frame number ordering is MSB->LSB within each 32-bit word. Word 0 is
+// the first PFN. This makes printf make more sense and works in the favor of
+// a potential `bfffo` version.
+//
+// Summary
+// One bit per bitmap word, same MSB-first ordering. A bit is set when the
+// word has at least one free page, so finding a free page is two `clz`s.
+// A second summary has a bit set for every word that is entirely free, and
+// `nfull` counts them: blocks of 32 pages and more are found there, or known
+// not to exist without looking. Smaller blocks still take a walk over the
+// words with free pages, but only until the walk fails: `frees` counts
+// changes that can make a block, and a failed order remembers it, so asking
+// again before anything is freed fails at once.
+//
+// Chunks
+// The bitmap only covers RAM. Each memory chunk gets its own stretch of bits,
+// starting at the same offset within a PMM_MAX_ORDER block as its first page
+// does in physical memory, so aligned bits are aligned pages. The gap between
+// two chunks' bits is at least one and fewer than 2^PMM_MAX_ORDER + 1 bits,
+// allocated for good, so no block spans two chunks and widely scattered RAM
+// doesn't need a bitmap for the holes. Both levels come from the early
+// allocator.
+//
+// Counters
+// `free_pages` follows every change to the bitmap, so nothing has to count
+// bits to know how much memory is left. `total_pages` is the RAM in the
+// chunks, without the holes. Releasing a range only frees what lies in the
+// chunks, so the holes never count as free.
+//
+// Page descriptors
+// A `struct pmm_page` for every bit, allocated with the bitmaps. Pages freed
+// to the bitmap are PMM_PAGE_FREE with no references, everything the
+// allocator hands out starts as PMM_PAGE_KERNEL with one reference.
+//
+// Zero pool
+// A few allocated pages that were cleared while the CPU was idle, handed out
+// by pmm_alloc_zeroed_page(). They count as used.
+
+typedef struct {
+    phys_bytes lo;      // whole pages of RAM
+    phys_bytes hi;
+    size_t first;       // bitmap bit of `lo`
+} pmm_chunk_t;
+
+typedef struct _pmm_state_t {
+    size_t npages; // bits tracked, chunks and the gaps between them
+    size_t hint;   // bitmap word the last page came from (next-fit)
+    size_t total_pages;
+    size_t free_pages;
+    size_t nzeroed;
+    phys_bytes zeroed[CONFIG_ZERO_POOL_PAGES];
+    uint32_t *page_bitmap;
+    uint32_t *summary;
+    uint32_t *full;     // summary of entirely free words
+    size_t nfull;
+    size_t frees;       // bumped whenever a page becomes free
+    size_t failed[PMM_MAX_ORDER + 1];   // `frees` when the order last failed
+    struct pmm_page *pages;
+    unsigned nchunks;
+    pmm_chunk_t chunks[BOOT_MAX_MEMRANGES]; // sorted
+} pmm_state_t;
+
+static pmm_state_t p_state = { 0 };
+
+#define WORD_BITS (32u)
+#define NUM_WORDS ((p_state.npages + WORD_BITS - 1) / WORD_BITS)
+#define NUM_SUMMARY_WORDS ((NUM_WORDS + WORD_BITS - 1) / WORD_BITS)
+
+// Pages in the largest block
+#define BLOCK_PAGES ((size_t)1 << PMM_MAX_ORDER)
+
+// The chunk holding `pa`, NULL if it isn't RAM
+static inline const pmm_chunk_t *pmm_chunk_of(phys_bytes pa)
+{
+    for (unsigned c = 0; c < p_state.nchunks; c++) {
+        const pmm_chunk_t *chunk = &p_state.chunks[c];
+        if (pa - chunk->lo < chunk->hi - chunk->lo) {
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+// Returns bit index into page_bitmap from physical address in `chunk`
+static inline size_t pfn_in_chunk(const pmm_chunk_t *chunk, phys_bytes pa) {
+    return chunk->first + (pa - chunk->lo) / PAGE_SIZE;
+}
+
+// Returns bit index into page_bitmap from physical address of RAM
+static inline size_t pfn_from_pa(phys_bytes pa) {
+    return pfn_in_chunk(pmm_chunk_of(pa), pa);
+}
+
+// Returns physical address from bit index into page_bitmap, a bit of a chunk
+static inline phys_bytes pa_from_pfn(size_t pfn) {
+    unsigned c = p_state.nchunks - 1;
+    while (c > 0 && p_state.chunks[c].first > pfn) {
+        c--;
+    }
+    return p_state.chunks[c].lo + (phys_bytes)((pfn - p_state.chunks[c].first) * PAGE_SIZE);
+}
+
+static inline phys_bytes align_up(phys_bytes addr, phys_bytes align)
+{
+    return (addr + (align - 1)) & ~(align - 1);
+}
+
+static inline phys_bytes align_down(phys_bytes addr, phys_bytes align)
+{
+    return addr & ~(align - 1);
+}
+
+
+/* --- bit operations --- */
+
+// Number of set bits. No libgcc, so no __builtin_popcount.
+static inline uint32_t pmm_popcount32(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    x = (x + (x >> 4)) & 0x0F0F0F0Fu;
+    return (x + (x >> 8) + (x >> 16) + (x >> 24)) & 0x3Fu;
+}
+
+static inline uint32_t pmm_mask_msbfirst(size_t pfn)
+{
+    // PFN within its 32-bit word: 0..31
+    const uint32_t k = (uint32_t)(pfn & (WORD_BITS - 1));
+    // MSB-first mapping: k=0 -> bit 31, k=31 -> bit 0
+    return 1u << (31u - k);
+}
+
+// A page in word `w` became free
+static inline void pmm_summary_set(size_t w)
+{
+    const uint32_t mask = pmm_mask_msbfirst(w);
+    p_state.summary[w >> 5] |= mask;
+    p_state.frees++;
+    if (p_state.page_bitmap[w] == ~0u && (p_state.full[w >> 5] & mask) == 0) {
+        p_state.full[w >> 5] |= mask;
+        p_state.nfull++;
+    }
+}
+
+// A page in word `w` was allocated, drop the word if it is now full
+static inline void pmm_summary_update(size_t w)
+{
+    const uint32_t mask = pmm_mask_msbfirst(w);
+    if (p_state.page_bitmap[w] == 0) {
+        p_state.summary[w >> 5] &= ~mask;
+    }
+    if ((p_state.full[w >> 5] & mask) != 0) {
+        p_state.full[w >> 5] &= ~mask;
+        p_state.nfull--;
+    }
+}
+
+static inline void pmm_set_free_or_trap(size_t pfn)
+{
+    uint32_t *word = &p_state.page_bitmap[pfn >> 5];
+    uint32_t mask  = pmm_mask_msbfirst(pfn);
+
+    if ((*word & mask) != 0) {
+        __builtin_trap(); // already free (double-free)
+    }
+    *word |= mask;
+    p_state.free_pages++;
+    pmm_summary_set(pfn >> 5);
+}
+
+static inline void pmm_clear_free_or_trap(size_t pfn)
+{
+    uint32_t *word = &p_state.page_bitmap[pfn >> 5];
+    uint32_t mask  = pmm_mask_msbfirst(pfn);
+
+    if ((*word & mask) == 0) {
+        __builtin_trap(); // already allocated (double-alloc)
+    }
+    *word &= ~mask;
+    p_state.free_pages--;
+    pmm_summary_update(pfn >> 5);
+}
+
+/* --- word-granular range operations --- */
+
+// Mask for `count` (1..32) pages starting at `pfn`, all within pfn's word
+static inline uint32_t pmm_mask_run_msbfirst(size_t pfn, size_t count)
+{
+    const uint32_t k   = (uint32_t)(pfn & (WORD_BITS - 1));
+    const uint32_t end = k + (uint32_t)count;
+    const uint32_t head = ~0u >> k; // pages k..31 of the word
+
+    return (end == WORD_BITS) ? head : head & ~(~0u >> end);
+}
+
+static inline void pmm_set_free_mask(size_t w, uint32_t mask, bool trap)
+{
+    uint32_t *word = &p_state.page_bitmap[w];
+
+    if (trap && (*word & mask) != 0) {
+        __builtin_trap(); // already free (double-free)
+    }
+    p_state.free_pages += pmm_popcount32(mask & ~*word);
+    *word |= mask;
+    pmm_summary_set(w);
+}
+
+static inline void pmm_clear_free_mask(size_t w, uint32_t mask, bool trap)
+{
+    uint32_t *word = &p_state.page_bitmap[w];
+
+    if (trap && (*word & mask) != mask) {
+        __builtin_trap(); // already allocated (double-alloc)
+    }
+    p_state.free_pages -= pmm_popcount32(mask & *word);
+    *word &= ~mask;
+    pmm_summary_update(w);
+}
+
+/*
+Mark pages [start_pfn, start_pfn + count) free. The partial words at either end
+are masked, every whole word in between is a single store.
+trap: a page that is already free is a double free
+*/
+static void pmm_set_free_run(size_t start_pfn, size_t count, bool trap)
+{
+    size_t pfn = start_pfn;
+    const size_t end = start_pfn + count;
+
+    if ((pfn & (WORD_BITS - 1)) != 0 && pfn < end) {
+        size_t n = WORD_BITS - (pfn & (WORD_BITS - 1));
+        if (n > end - pfn) n = end - pfn;
+        pmm_set_free_mask(pfn >> 5, pmm_mask_run_msbfirst(pfn, n), trap);
+        pfn += n;
+    }
+    for (; end - pfn >= WORD_BITS; pfn += WORD_BITS) {
+        pmm_set_free_mask(pfn >> 5, ~0u, trap);
+    }
+    if (pfn < end) {
+        pmm_set_free_mask(pfn >> 5, pmm_mask_run_msbfirst(pfn, end - pfn), trap);
+    }
+}
+
+/*
+Mark pages [start_pfn, start_pfn + count) allocated, same shape as above.
+trap: a page that is already allocated is a double allocation
+*/
+static void pmm_clear_free_run(size_t start_pfn, size_t count, bool trap)
+{
+    size_t pfn = start_pfn;
+    const size_t end = start_pfn + count;
+
+    if ((pfn & (WORD_BITS - 1)) != 0 && pfn < end) {
+        size_t n = WORD_BITS - (pfn & (WORD_BITS - 1));
+        if (n > end - pfn) n = end - pfn;
+        pmm_clear_free_mask(pfn >> 5, pmm_mask_run_msbfirst(pfn, n), trap);
+        pfn += n;
+    }
+    for (; end - pfn >= WORD_BITS; pfn += WORD_BITS) {
+        pmm_clear_free_mask(pfn >> 5, ~0u, trap);
+    }
+    if (pfn < end) {
+        pmm_clear_free_mask(pfn >> 5, pmm_mask_run_msbfirst(pfn, end - pfn), trap);
+    }
+}
+
+static inline int first_set_bit_msbfirst_u32(uint32_t word)
+{
+    if (!word) return -1;
+    return __builtin_clz(word);
+}
+
+/*
+Find a bitmap word with a free page, starting at word `from` and wrapping
+around the end of the bitmap.
+Returns the word index, or SIZE_MAX if memory is full.
+*/
+static size_t pmm_find_nonempty_word(size_t from)
+{
+    const size_t nsum = NUM_SUMMARY_WORDS;
+    size_t s = from >> 5;
+
+    // Only words at or after `from` count on the first pass...
+    uint32_t bits = p_state.summary[s] & (~0u >> (from & (WORD_BITS - 1)));
+    for (size_t n = 0; n <= nsum; n++) {
+        if (bits != 0) {
+            return s * WORD_BITS + (size_t)first_set_bit_msbfirst_u32(bits);
+        }
+        // ...the rest of the starting word is picked up after wrapping.
+        s = (s + 1 == nsum) ? 0 : s + 1;
+        bits = p_state.summary[s];
+    }
+    return SIZE_MAX;
+}
+
+// Reset the descriptors of pages [pfn, pfn + count)
+static void pmm_pages_set(size_t pfn, size_t count, uint8_t type, uint16_t refcount)
+{
+    struct pmm_page *pg = &p_state.pages[pfn];
+    for (size_t i = 0; i < count; i++)
+    {
+        pg[i] = (struct pmm_page){ .refcount = refcount, .type = type };
+    }
+}
+
+static void pmm_init_all_allocated(void)
+{
+    LOG_T("pmm_init_all_allocated()\n");
+    for (size_t i = 0; i < NUM_WORDS; i++)
+    {
+        p_state.page_bitmap[i] = 0u;
+    }
+    for (size_t i = 0; i < NUM_SUMMARY_WORDS; i++)
+    {
+        p_state.summary[i] = 0u;
+        p_state.full[i] = 0u;
+    }
+    p_state.nfull = 0;
+    for (size_t i = 0; i < ARRAY_LEN(p_state.failed); i++)
+    {
+        p_state.failed[i] = SIZE_MAX;
+    }
+    pmm_pages_set(0, p_state.npages, PMM_PAGE_KERNEL, 1);
+    p_state.hint = 0;
+    p_state.free_pages = 0;
+}
+
+/*
+Mark a range of pages as free.
+start_pfn: page frame number
+count: number of pages
+*/
+static void pmm_free_range(size_t start_pfn, phys_pages count)
+{
+    if (start_pfn >= p_state.npages) return;
+    if (count > (p_state.npages - start_pfn)) {
+        count = p_state.npages - start_pfn;
+    }
+    pmm_set_free_run(start_pfn, count, false);
+    pmm_pages_set(start_pfn, count, PMM_PAGE_FREE, 0);
+}
+
+/*
+Mark a range of pages as allocated.
+*/
+static void pmm_alloc_range(size_t start_pfn, phys_pages count)
+{
+    if (start_pfn >= p_state.npages) return;
+    if (count > (p_state.npages - start_pfn)) {
+        count = p_state.npages - start_pfn;
+    }
+    pmm_clear_free_run(start_pfn, count, false);
+    pmm_pages_set(start_pfn, count, PMM_PAGE_KERNEL, 1);
+}
+
+#ifdef DEBUG
+static void print_bitmap()
+{
+    for (uint32_t i = 0; i < NUM_WORDS; i++)
+    {
+        printk("%.32b %08lx\n", p_state.page_bitmap[i], p_state.page_bitmap[i]);
+    }
+}
+#endif
+
+/*
+Allocate 1 page.
+Returns:
+    physical address (multiple of PAGE_SIZE) on success
+    0xFFFFFFFF on failure
+*/
+phys_bytes pmm_alloc_page(void)
+{
+    const size_t w = pmm_find_nonempty_word(p_state.hint);
+    if (w == SIZE_MAX) {
+        // Last resort, a cleared page is still a page
+        if (p_state.nzeroed != 0) {
+            const phys_bytes pa = p_state.zeroed[--p_state.nzeroed];
+            p_state.pages[pfn_from_pa(pa)].type = PMM_PAGE_KERNEL;
+            return pa;
+        }
+        return 0xFFFFFFFFu;
+    }
+
+    const int bit = first_set_bit_msbfirst_u32(p_state.page_bitmap[w]);
+    const size_t pfn = w * WORD_BITS + (size_t)bit;
+
+    pmm_clear_free_or_trap(pfn);
+    pmm_pages_set(pfn, 1, PMM_PAGE_KERNEL, 1);
+    p_state.hint = w;
+    return pa_from_pfn(pfn);
+}
+
+/* --- multi-page (buddy) allocation --- */
+
+/*
+Blocks are 2^order pages, naturally aligned to their size in physical memory.
+
+The bitmap stays the only record of what is free. A block's buddy is just the
+neighbouring aligned run of bits, so a freed block coalesces with its buddy as
+soon as its bits are set again, and pmm_reserve_range()/pmm_release_range()
+need no extra bookkeeping.
+*/
+
+// MSB-first bit positions that may start an aligned block, by order (0..5)
+static const uint32_t pmm_order_starts[] = {
+    0xFFFFFFFFu, 0xAAAAAAAAu, 0x88888888u, 0x80808080u, 0x80008000u, 0x80000000u,
+};
+
+// Bits of `word` that start an aligned run of 2^order free pages (order 0..5)
+static inline uint32_t pmm_word_free_runs(uint32_t word, unsigned order)
+{
+    // After the shift by `s`, bit k is only set if pages k..k+2s-1 are free
+    for (uint32_t s = 1; s < (1u << order); s <<= 1) {
+        word &= word << s;
+    }
+    return word & pmm_order_starts[order];
+}
+
+// Find a block of up to 16 pages inside a single bitmap word
+static size_t pmm_find_block_in_word(unsigned order)
+{
+    // Only words the summary says have free pages are worth looking at
+    for (size_t s = 0; s < NUM_SUMMARY_WORDS; s++) {
+        uint32_t words = p_state.summary[s];
+        while (words != 0) {
+            const int bit = first_set_bit_msbfirst_u32(words);
+            words &= ~(0x80000000u >> bit);
+
+            const size_t w = s * WORD_BITS + (size_t)bit;
+            const uint32_t runs = pmm_word_free_runs(p_state.page_bitmap[w], order);
+            if (runs != 0) {
+                return w * WORD_BITS + (size_t)first_set_bit_msbfirst_u32(runs);
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+_Static_assert(PMM_MAX_ORDER <= 10, "blocks span at most one word of the full summary");
+
+// Find a block spanning 2^(order-5) whole bitmap words: an aligned run of
+// bits in the full summary, one summary word at most
+static size_t pmm_find_block_in_words(unsigned order)
+{
+    if (p_state.nfull < ((size_t)1 << (order - 5))) {
+        return SIZE_MAX;
+    }
+
+    // Aligned bits are aligned pages, see pmm_init()
+    for (size_t s = 0; s < NUM_SUMMARY_WORDS; s++) {
+        const uint32_t runs = pmm_word_free_runs(p_state.full[s], order - 5);
+        if (runs != 0) {
+            const size_t w = s * WORD_BITS + (size_t)first_set_bit_msbfirst_u32(runs);
+            return w * WORD_BITS;
+        }
+    }
+    return SIZE_MAX;
+}
+
+/*
+Allocate 2^order physically contiguous pages.
+Returns:
+    physical address (aligned to PAGE_SIZE << order) on success
+    0xFFFFFFFF on failure
+*/
+phys_bytes pmm_alloc_pages(unsigned order)
+{
+    if (order > PMM_MAX_ORDER) {
+        return PMM_INVALID_PA;
+    }
+
+    // Nothing was freed since the last search failed
+    if (p_state.failed[order] == p_state.frees) {
+        return PMM_INVALID_PA;
+    }
+
+    const size_t pfn = (order < 5)
+        ? pmm_find_block_in_word(order)
+        : pmm_find_block_in_words(order);
+    if (pfn == SIZE_MAX) {
+        p_state.failed[order] = p_state.frees;
+        return PMM_INVALID_PA;
+    }
+
+    pmm_clear_free_run(pfn, (size_t)1 << order, true);
+    pmm_pages_set(pfn, (size_t)1 << order, PMM_PAGE_KERNEL, 1);
+    return pa_from_pfn(pfn);
+}
+
+/*
+Free a block from pmm_alloc_pages().
+phys_addr: Physical address of the block
+order: Same order the block was allocated with
+*/
+void pmm_free_pages(phys_bytes phys_addr, unsigned order)
+{
+    if (order > PMM_MAX_ORDER) __builtin_trap();
+
+    const phys_bytes block_size = (phys_bytes)PAGE_SIZE << order;
+    if ((phys_addr & (block_size - 1u)) != 0u) __builtin_trap();
+    const pmm_chunk_t *chunk = pmm_chunk_of(phys_addr);
+    if (!chunk || chunk->hi - phys_addr < block_size) __builtin_trap();
+
+    const size_t pfn = pfn_in_chunk(chunk, phys_addr);
+    if (p_state.pages[pfn].refcount > 1) {
+        LOG_E("Freeing shared block pa=%08lx\n", phys_addr);
+        __builtin_trap();
+    }
+    pmm_set_free_run(pfn, (size_t)1 << order, true);
+    pmm_pages_set(pfn, (size_t)1 << order, PMM_PAGE_FREE, 0);
+}
+
+/*
+Free 1 page by physical address.
+phys_addr: Physical address of page frame (must be aligned!)
+*/
+void pmm_free_page(phys_bytes phys_addr)
+{
+    if ((phys_addr & (PAGE_SIZE - 1u)) != 0u) __builtin_trap();
+    const pmm_chunk_t *chunk = pmm_chunk_of(phys_addr);
+    if (!chunk) __builtin_trap();
+
+    size_t pfn = pfn_in_chunk(chunk, phys_addr);
+    if (p_state.pages[pfn].refcount > 1) {
+        LOG_E("Freeing shared page pa=%08lx\n", phys_addr);
+        __builtin_trap();
+    }
+    pmm_set_free_or_trap(pfn);
+    pmm_pages_set(pfn, 1, PMM_PAGE_FREE, 0);
+}
+
+/* --- page descriptors --- */
+
+struct pmm_page *pmm_page(phys_bytes pa)
+{
+    const pmm_chunk_t *chunk = pmm_chunk_of(pa);
+    if (!chunk) {
+        return NULL;
+    }
+    return &p_state.pages[pfn_in_chunk(chunk, pa)];
+}
+
+void pmm_page_ref(phys_bytes pa)
+{
+    struct pmm_page *pg = pmm_page(pa);
+    if (!pg || pg->refcount == 0 || pg->refcount == UINT16_MAX) {
+        LOG_E("Bad reference to pa=%08lx\n", pa);
+        __builtin_trap();
+    }
+    pg->refcount++;
+}
+
+bool pmm_page_unref(phys_bytes pa)
+{
+    struct pmm_page *pg = pmm_page(pa);
+    if (!pg || pg->refcount == 0) {
+        LOG_E("Unbalanced unref of pa=%08lx\n", pa);
+        __builtin_trap();
+    }
+    if (pg->refcount == 1) {
+        pmm_free_page(pa);
+        return true;
+    }
+    pg->refcount--;
+    return false;
+}
+
+/* --- pre-zeroed pages --- */
+
+static inline void pmm_zero_page(phys_bytes pa)
+{
+    zero_lines((void*)(uintptr_t)phys_to_virt(pa), PAGE_SIZE);
+}
+
+/*
+Allocate 1 page filled with zeros. Comes from the zero pool when it has a
+page, otherwise the page is cleared here.
+Returns:
+    physical address (multiple of PAGE_SIZE) on success
+    0xFFFFFFFF on failure
+*/
+phys_bytes pmm_alloc_zeroed_page(void)
+{
+    if (p_state.nzeroed != 0) {
+        const phys_bytes pa = p_state.zeroed[--p_state.nzeroed];
+        p_state.pages[pfn_from_pa(pa)].type = PMM_PAGE_KERNEL;
+        return pa;
+    }
+
+    const phys_bytes pa = pmm_alloc_page();
+    if (pa != PMM_INVALID_PA) {
+        pmm_zero_page(pa);
+    }
+    return pa;
+}
+
+bool pmm_refill_zero_pool(void)
+{
+    if (p_state.nzeroed >= CONFIG_ZERO_POOL_PAGES) {
+        return false;
+    }
+
+    // Don't take the last free pages for the pool
+    if (p_state.free_pages <= CONFIG_ZERO_POOL_PAGES) {
+        return false;
+    }
+
+    const phys_bytes pa = pmm_alloc_page();
+    if (pa == PMM_INVALID_PA) {
+        return false;
+    }
+    pmm_zero_page(pa);
+    p_state.pages[pfn_from_pa(pa)].type = PMM_PAGE_ZERO;
+    p_state.zeroed[p_state.nzeroed++] = pa;
+    return true;
+}
+
+/*
+Run `fn` on the pages of [start, end) in each chunk. The holes between
+chunks have no bits, they stay allocated.
+*/
+static void pmm_chunk_runs(phys_bytes start, phys_bytes end, void (*fn)(size_t, phys_pages))
+{
+    for (unsigned c = 0; c < p_state.nchunks; c++) {
+        const pmm_chunk_t *chunk = &p_state.chunks[c];
+        const phys_bytes s = start > chunk->lo ? start : chunk->lo;
+        const phys_bytes e = end < chunk->hi ? end : chunk->hi;
+        if (e <= s) continue;
+
+        const size_t start_pfn = pfn_in_chunk(chunk, s);
+        const phys_pages count = (e - s) / PAGE_SIZE;
+        LOG_T("start_pfn=0x%lx count=0x%lx\n", start_pfn, count);
+        fn(start_pfn, count);
+    }
+}
+
+void pmm_release_range(phys_bytes base, phys_bytes size)
+{
+    LOG_T("Base=0x%08lx Size=0x%08lx\n", base, size);
+
+    const phys_bytes start = align_up(base, PAGE_SIZE);
+    const phys_bytes end   = align_down(base + size, PAGE_SIZE);
+    pmm_chunk_runs(start, end, pmm_free_range);
+}
+
+void pmm_reserve_range(phys_bytes base, phys_bytes size)
+{
+    LOG_T("Base=0x%08lx Size=0x%08lx\n", base, size);
+
+    const phys_bytes start = align_down(base, PAGE_SIZE);
+    const phys_bytes end   = align_up(base + size, PAGE_SIZE);
+    pmm_chunk_runs(start, end, pmm_alloc_range);
+}
+
+/* --- hand-off from the early allocator --- */
+
+static void pmm_chunk_cb(phys_bytes base, phys_bytes size, void *ctx)
+{
+    (void)ctx;
+    phys_bytes end = base + size;
+    if (end < base) {
+        end = -(phys_bytes)PAGE_SIZE; // chunk runs to the top of memory
+    }
+    const phys_bytes lo = align_up(base, PAGE_SIZE);
+    const phys_bytes hi = align_down(end, PAGE_SIZE);
+    if (hi <= lo) {
+        return;
+    }
+
+    // The early allocator hands chunks over sorted and merged
+    if (p_state.nchunks == BOOT_MAX_MEMRANGES) {
+        LOG_E("Too many memory chunks!\n");
+        __builtin_trap();
+    }
+    p_state.chunks[p_state.nchunks++] = (pmm_chunk_t){ .lo = lo, .hi = hi };
+}
+
+static void pmm_release_cb(phys_bytes base, phys_bytes size, void *ctx)
+{
+    (void)ctx;
+    pmm_release_range(base, size);
+}
+
+static void pmm_reserve_cb(phys_bytes base, phys_bytes size, void *ctx)
+{
+    (void)ctx;
+    pmm_reserve_range(base, size);
+}
+
+void pmm_init(void)
+{
+    ea_for_each_memory(pmm_chunk_cb, NULL);
+    if (p_state.nchunks == 0) {
+        LOG_E("No memory to manage!\n");
+        __builtin_trap();
+    }
+
+    // Lay the chunks out back to back, each at its page's offset within a
+    // block so bit positions line up with naturally aligned physical blocks
+    // for pmm_alloc_pages(). At least one bit in between keeps blocks from
+    // spanning two chunks.
+    size_t next = 0;
+    for (unsigned c = 0; c < p_state.nchunks; c++) {
+        pmm_chunk_t *chunk = &p_state.chunks[c];
+        const size_t pfn = chunk->lo / PAGE_SIZE;
+        const size_t want = c == 0 ? 0 : next + 1;
+        chunk->first = want + ((pfn - want) & (BLOCK_PAGES - 1));
+        next = chunk->first + (chunk->hi - chunk->lo) / PAGE_SIZE;
+    }
+    p_state.npages = next;
+
+    LOG_T("chunks=%u npages=%u\n", p_state.nchunks, p_state.npages);
+
+    // The bitmap, both summaries and the page descriptors in one block, sized by the
+    // RAM in the chunks rather than the span they are spread over. It has to
+    // be reachable through the mapping head.S set up, the linear map doesn't
+    // exist yet. The early allocator reserves it, so it is handed over below
+    // with everything else.
+    const phys_bytes meta_size = (NUM_WORDS + 2 * NUM_SUMMARY_WORDS) * sizeof(uint32_t)
+                               + p_state.npages * sizeof(struct pmm_page);
+    const phys_bytes meta_pa = ea_alloc_or_panic(meta_size, sizeof(uint32_t),
+        (phys_bytes)phys_kernel_start,
+        (phys_bytes)(phys_kernel_start + init_mapped_size));
+
+    p_state.page_bitmap = (uint32_t*)(uintptr_t)phys_to_virt(meta_pa);
+    p_state.summary     = p_state.page_bitmap + NUM_WORDS;
+    p_state.full        = p_state.summary + NUM_SUMMARY_WORDS;
+    p_state.pages       = (struct pmm_page*)(p_state.full + NUM_SUMMARY_WORDS);
+
+    // The bits between chunks stay allocated. Both lists are sorted and
+    // merged, so this is one run operation per chunk and per reservation.
+    pmm_init_all_allocated();
+    ea_for_each_memory(pmm_release_cb, NULL);
+    p_state.total_pages = p_state.free_pages;
+    ea_for_each_reserved(pmm_reserve_cb, NULL);
+
+    // The PMM owns physical memory from here on
+    ea_finalize();
+}
+
+/* --- statistics --- */
+
+phys_pages pmm_free_page_count(void)
+{
+    return (phys_pages)p_state.free_pages;
+}
+
+static void pmm_stats_add_run(struct pmm_stats *st, size_t run)
+{
+    if (run == 0) return;
+
+    st->free_runs++;
+    if (run > st->largest_free_run) {
+        st->largest_free_run = run;
+    }
+    unsigned k = 31u - (unsigned)__builtin_clz((uint32_t)run);
+    if (k >= PMM_RUN_BUCKETS) k = PMM_RUN_BUCKETS - 1;
+    st->run_hist[k]++;
+}
+
+/*
+Walk the bitmap once, measuring every stretch of free pages. Full and empty
+words are handled whole, mixed words a run at a time with `clz`.
+Tail bits past the last page are always 0, so they end the final run.
+*/
+static void pmm_scan_free_runs(struct pmm_stats *st)
+{
+    size_t run = 0;
+
+    for (size_t w = 0; w < NUM_WORDS; w++)
+    {
+        uint32_t word = p_state.page_bitmap[w];
+        if (word == ~0u) {
+            run += WORD_BITS;
+            continue;
+        }
+        if (word == 0u) {
+            pmm_stats_add_run(st, run);
+            run = 0;
+            continue;
+        }
+
+        // `bits` MSBs of `word` are still to be looked at
+        uint32_t bits = WORD_BITS;
+        while (bits != 0) {
+            const uint32_t ones = (uint32_t)__builtin_clz(~word);   // ~word != 0 here
+            if (ones >= bits) {
+                run += bits;
+                break;
+            }
+            run += ones;
+            pmm_stats_add_run(st, run);
+            run = 0;
+            word <<= ones;
+            bits -= ones;
+
+            const uint32_t zeros = (word == 0u) ? WORD_BITS : (uint32_t)__builtin_clz(word);
+            if (zeros >= bits) {
+                break;
+            }
+            word <<= zeros;
+            bits -= zeros;
+        }
+    }
+    pmm_stats_add_run(st, run);
+}
+
+void pmm_get_stats(struct pmm_stats *st)
+{
+    *st = (struct pmm_stats){
+        .page_size   = PAGE_SIZE,
+        .total_pages = p_state.total_pages,
+        .free_pages  = p_state.free_pages,
+        .used_pages  = p_state.total_pages - p_state.free_pages,
+    };
+    pmm_scan_free_runs(st);
+}
+
+void pmm_print_free_mem(void)
+{
+    char sizbuf[16];
+    struct pmm_stats st;
+    pmm_get_stats(&st);
+
+    uint32_t free = st.free_pages * PAGE_SIZE;
+    format_bytes_iec_1dp(free, sizbuf, ARRAY_LEN(sizbuf));
+    LOG("%s (0x%08lx) free, %lu/%lu pages used\n", sizbuf, free,
+        st.used_pages, st.total_pages);
+    LOG("%lu free runs, largest %lu pages\n", st.free_runs, st.largest_free_run);
+#ifdef DEBUG
+    print_bitmap();
+#endif
+}
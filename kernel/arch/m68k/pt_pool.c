@@ -0,0 +1,433 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <form_os/config.h>
+#include <form_os/type.h>
+
+#include "kernel/mm.h"
+#include "kernel/printk.h"
+#include "arch/klib.h"
+#include "arch/mm.h"
+#include "arch/pgtable.h"
+#include "arch/pt_pool.h"
+
+/* ---------------- root/pointer/page table allocation ---------------------- */
+
+// Root and pointer tables are RPTABLE_SIZE (512) bytes. Page tables are
+// PGTABLE_SIZE bytes: PAGE_ENTRIES descriptors, enough PAGE_SIZE pages to
+// cover 256 KiB. Both are carved out of whole PAGE_SIZE pages taken from the
+// PMM, one node per page. The page's descriptor points back at its node, so
+// a block is freed without searching for it.
+//
+// Each block size keeps its nodes on three lists by how many blocks are
+// free: some (partial), none (full) or all (empty). Allocation takes the
+// head of the partial list, falling back to an empty node, so neither
+// path depends on how many tables exist.
+//
+// A node that empties gives its page back to the PMM once empty nodes
+// outnumber both CONFIG_PT_POOL_EMPTY_PAGES and the nodes in use. That
+// keeps a rebuild after a teardown cheap, and `pt_pool_trim` brings the
+// surplus down to CONFIG_PT_POOL_EMPTY_PAGES while idle.
+//
+// Nodes live in slab pages taken from the PMM as well, so there is no
+// fixed limit on the number of pool pages.
+//
+// A node also keeps one bit per descriptor in its page, for the VM code to
+// track which entries of each table are in use.
+
+typedef enum {
+    PTBLK_PTR  = RPTABLE_SIZE,
+    PTBLK_PAGE = PGTABLE_SIZE,
+} ptblk_t;
+
+// Up to 64 page tables fit in an 8KiB page. Masks are kept in 32-bit words,
+// 64-bit shifts would need libgcc.
+#define POOL_MAX_BLOCKS     (PAGE_SIZE / PGTABLE_SIZE)
+#define POOL_MASK_WORDS     ((POOL_MAX_BLOCKS + 31) / 32)
+
+// One bit per 4-byte descriptor. Tables are at least 128 bytes, so each
+// starts on a word of its own.
+#define POOL_USED_WORDS     (PAGE_SIZE / (32 * sizeof(uint32_t)))
+
+typedef struct pt_pool_page {
+    struct pt_pool_page *next;
+    struct pt_pool_page *prev;
+    ptblk_t ty;
+    phys_bytes pa;              // page-aligned base
+    uint32_t free_mask[POOL_MASK_WORDS]; // bit=1 => free block, LSB first
+    uint16_t nfree;             // set bits in free_mask
+    uint32_t used_map[POOL_USED_WORDS]; // see pt_table_used_map
+} pt_pool_page_t;
+
+// A page of nodes, the header sits at the start of the page
+typedef struct pt_node_slab {
+    struct pt_node_slab *next;
+    struct pt_node_slab *prev;
+    pt_pool_page_t *free;       // unused nodes, linked through `next`
+    size_t used;
+    pt_pool_page_t nodes[];
+} pt_node_slab_t;
+
+#define NODES_PER_SLAB ((PAGE_SIZE - sizeof(pt_node_slab_t)) / sizeof(pt_pool_page_t))
+
+typedef struct pt_pool_class {
+    pt_pool_page_t *partial;
+    pt_pool_page_t *full;
+    pt_pool_page_t *empty;
+    size_t nempty;
+    size_t nnodes;
+} pt_pool_class_t;
+
+typedef struct pt_pool {
+    pt_node_slab_t *slabs;      // slabs with unused nodes
+    pt_pool_class_t c_ptr;
+    pt_pool_class_t c_page;
+} pt_pool_t;
+
+static pt_pool_t g_ptpool;
+
+/* --- node slabs --- */
+
+static inline void slab_list_push(pt_node_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = g_ptpool.slabs;
+    if (g_ptpool.slabs)
+        g_ptpool.slabs->prev = slab;
+    g_ptpool.slabs = slab;
+}
+
+static inline void slab_list_remove(pt_node_slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        g_ptpool.slabs = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static pt_pool_page_t* pool_node_alloc(void)
+{
+    pt_node_slab_t *slab = g_ptpool.slabs;
+    if (!slab) {
+        const phys_bytes pa = pmm_alloc_page();
+        if (pa == PMM_INVALID_PA) {
+            LOG_E("Failed to allocate page for pt_pool_page_t!\n");
+            __builtin_trap();
+        }
+        // Marked as pool memory, but with no node it can't be freed as a table
+        pmm_page(pa)->type = PMM_PAGE_PT_POOL;
+
+        slab = (pt_node_slab_t*)(uintptr_t)phys_to_virt(pa);
+        slab->used = 0;
+        slab->free = NULL;
+        for (size_t i = NODES_PER_SLAB; i-- > 0; ) {
+            slab->nodes[i].next = slab->free;
+            slab->free = &slab->nodes[i];
+        }
+        slab_list_push(slab);
+    }
+
+    pt_pool_page_t *node = slab->free;
+    slab->free = node->next;
+    slab->used++;
+    if (!slab->free) {
+        slab_list_remove(slab);
+    }
+    return node;
+}
+
+static void pool_node_free(pt_pool_page_t *node)
+{
+    pt_node_slab_t *slab = (pt_node_slab_t*)((uintptr_t)node & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (!slab->free) {
+        slab_list_push(slab);
+    }
+    node->next = slab->free;
+    slab->free = node;
+    slab->used--;
+
+    // Keep the last slab with room around, a new address space needs it next
+    if (slab->used == 0 && (slab->next || slab->prev)) {
+        slab_list_remove(slab);
+        pmm_free_page(virt_to_phys((virt_bytes)(uintptr_t)slab));
+    }
+}
+
+/* --- pool pages --- */
+
+static inline pt_pool_class_t* pool_class(ptblk_t ty)
+{
+    return (ty == PTBLK_PAGE)
+        ? &g_ptpool.c_page
+        : &g_ptpool.c_ptr;
+}
+
+static inline uint16_t pool_blocks(ptblk_t ty)
+{
+    return (uint16_t)(PAGE_SIZE / ty);
+}
+
+static inline bool pool_block_free(const pt_pool_page_t *node, size_t i)
+{
+    return (node->free_mask[i / 32] & (1u << (i % 32))) != 0;
+}
+
+// The list for a node with `nfree` free blocks
+static inline pt_pool_page_t** pool_list_for(pt_pool_class_t *cls, ptblk_t ty, uint16_t nfree)
+{
+    if (nfree == 0)
+        return &cls->full;
+    if (nfree == pool_blocks(ty))
+        return &cls->empty;
+    return &cls->partial;
+}
+
+static inline void pool_list_push(pt_pool_class_t *cls, pt_pool_page_t **headp, pt_pool_page_t *node)
+{
+    node->prev = NULL;
+    node->next = *headp;
+    if (*headp)
+        (*headp)->prev = node;
+    *headp = node;
+    if (headp == &cls->empty)
+        cls->nempty++;
+}
+
+static inline void pool_list_remove(pt_pool_class_t *cls, pt_pool_page_t **headp, pt_pool_page_t *node)
+{
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        *headp = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+    if (headp == &cls->empty)
+        cls->nempty--;
+}
+
+// Give an empty node's page back to the PMM and drop the node
+static void pool_release_node(pt_pool_class_t *cls, pt_pool_page_t *node)
+{
+    pool_list_remove(cls, &cls->empty, node);
+    cls->nnodes--;
+    pmm_free_page(node->pa);
+    pool_node_free(node);
+}
+
+// Whether the class has more empty nodes than it should keep, with `in_use`
+// nodes holding tables
+static inline bool pool_surplus(const pt_pool_class_t *cls, size_t in_use)
+{
+    return cls->nempty > CONFIG_PT_POOL_EMPTY_PAGES && cls->nempty > in_use;
+}
+
+// Move a node whose free count changed from `old_nfree` to the list it now
+// belongs on
+static inline void pool_relist(pt_pool_page_t *node, uint16_t old_nfree)
+{
+    pt_pool_class_t *cls = pool_class(node->ty);
+    pt_pool_page_t **from = pool_list_for(cls, node->ty, old_nfree);
+    pt_pool_page_t **to   = pool_list_for(cls, node->ty, node->nfree);
+
+    if (from == to)
+        return;
+    pool_list_remove(cls, from, node);
+    pool_list_push(cls, to, node);
+
+    if (to == &cls->empty && pool_surplus(cls, cls->nnodes - cls->nempty)) {
+        pool_release_node(cls, node);
+    }
+}
+
+// Get a node with free slots, allocate a new page if none are found.
+static inline pt_pool_page_t* pool_get_node(ptblk_t ty)
+{
+    pt_pool_class_t *cls = pool_class(ty);
+
+    // Fill partial nodes first, so empty ones stay empty
+    pt_pool_page_t *n = cls->partial ? cls->partial : cls->empty;
+    if (n) {
+        if (n->ty != ty || n->nfree == 0) {
+            LOG_E("Invalid node in the %d lists!\n", ty);
+            __builtin_trap();
+        }
+        return n;
+    }
+
+    phys_bytes pa = pmm_alloc_page();
+    if (pa == PMM_INVALID_PA) {
+        LOG_E("Failed to allocate page for %d blocks!\n", ty);
+        __builtin_trap();
+    }
+
+    pt_pool_page_t *new = pool_node_alloc();
+    struct pmm_page *pg = pmm_page(pa);
+    pg->type  = PMM_PAGE_PT_POOL;
+    pg->owner = new;
+    new->pa = pa;
+    new->ty = ty;
+    new->nfree = pool_blocks(ty);
+    for (size_t w = 0; w < POOL_MASK_WORDS; w++) {
+        const size_t first = w * 32;
+        if (new->nfree >= first + 32) {
+            new->free_mask[w] = 0xFFFFFFFFu;
+        } else if (new->nfree > first) {
+            new->free_mask[w] = (1u << (new->nfree - first)) - 1;
+        } else {
+            new->free_mask[w] = 0;
+        }
+    }
+    for (size_t w = 0; w < POOL_USED_WORDS; w++) {
+        new->used_map[w] = 0;
+    }
+    pool_list_push(cls, &cls->empty, new);
+    cls->nnodes++;
+    return new;
+}
+
+bool pt_pool_trim(void)
+{
+    pt_pool_class_t *const classes[] = { &g_ptpool.c_page, &g_ptpool.c_ptr };
+    for (size_t i = 0; i < 2; i++) {
+        pt_pool_class_t *cls = classes[i];
+        if (pool_surplus(cls, 0)) {
+            pool_release_node(cls, cls->empty);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_pool_page(pt_pool_page_t* p)
+{
+    printk("pt_pool_page_t at %08lx\n", (uint32_t)(uintptr_t)p);
+    printk("    pa=%08lx\n", p->pa);
+    for (size_t w = 0; w < POOL_MASK_WORDS; w++) {
+        printk("  free=%032b\n", p->free_mask[w]);
+    }
+    printk("  next=%08lx\n", (uint32_t)(uintptr_t)p->next);
+}
+
+static void print_pool_list(const char *name, pt_pool_page_t *head)
+{
+    printk("%s...\n", name);
+    for (pt_pool_page_t *node = head; node; node = node->next) {
+        print_pool_page(node);
+    }
+}
+
+void print_ptpool(void)
+{
+    print_pool_list("page table partial", g_ptpool.c_page.partial);
+    print_pool_list("page table full",    g_ptpool.c_page.full);
+    print_pool_list("page table empty",   g_ptpool.c_page.empty);
+    print_pool_list("ptr table partial",  g_ptpool.c_ptr.partial);
+    print_pool_list("ptr table full",     g_ptpool.c_ptr.full);
+    print_pool_list("ptr table empty",    g_ptpool.c_ptr.empty);
+}
+
+static inline void pool_clear_block_mem(const phys_bytes slot_pa, const ptblk_t ty)
+{
+    LOG_T("0x%08lx size=%d\n", slot_pa, ty);
+    zero_lines((void*)(uintptr_t)phys_to_virt(slot_pa), (size_t)ty);
+}
+
+static inline phys_bytes pool_alloc_block_from_node(pt_pool_page_t* const node, const ptblk_t ty)
+{
+    // Any free block will do, take the highest one in the first word with
+    // one (bfffo on the 040)
+    for (size_t w = 0; w < POOL_MASK_WORDS; w++)
+    {
+        const uint32_t word = node->free_mask[w];
+        if (word == 0)
+            continue;
+
+        const size_t i = w * 32 + (31 - (size_t)__builtin_clz(word));
+        const uint16_t old_nfree = node->nfree--;
+        node->free_mask[w] &= ~(1u << (i % 32)); // clear the bit
+        pool_relist(node, old_nfree);
+        const phys_bytes pa = node->pa + i * ty;
+        pool_clear_block_mem(pa, ty);
+        for (size_t u = 0; u < ty / (32 * sizeof(uint32_t)); u++) {
+            node->used_map[i * ty / (32 * sizeof(uint32_t)) + u] = 0;
+        }
+        LOG_T("%08lx\n", pa);
+        return pa;
+    }
+    return PMM_INVALID_PA;
+}
+
+static inline void pool_free_block_from_node(const phys_bytes pa, const ptblk_t ty)
+{
+    if ((pa & (ty - 1)) != 0) {
+        LOG_E("Tried to free %d block for misaligned pa=%08lx\n", ty, pa);
+        __builtin_trap();
+    }
+
+    const size_t limit = pool_blocks(ty);
+
+    // The page descriptor knows the node
+    const phys_bytes base = pa & PAGE_ADDR_MASK;
+    const struct pmm_page *pg = pmm_page(base);
+    pt_pool_page_t *node = pg ? pg->owner : NULL;
+    if (!node || pg->type != PMM_PAGE_PT_POOL || node->pa != base || node->ty != ty) {
+        LOG_E("Failed to find allocated %d block for pa=%08lx\n", ty, pa);
+        __builtin_trap();
+    }
+
+    if ((pa - node->pa) % ty != 0) {
+        LOG_E("Tried to free misaligned block!\n");
+        __builtin_trap();
+    }
+
+    const size_t slot = (pa - node->pa) / (size_t)ty;
+    if (slot >= limit) {
+        LOG_E("Tried to free %d slot #%d out of range\n", ty, slot);
+        __builtin_trap();
+    }
+    if (pool_block_free(node, slot)) {
+        LOG_E("Double free of %d block pa=%08lx\n", ty, pa);
+        __builtin_trap();
+    }
+    const uint16_t old_nfree = node->nfree++;
+    node->free_mask[slot / 32] |= 1u << (slot % 32);
+    pool_relist(node, old_nfree);
+}
+
+phys_bytes pt_alloc_ptr_table_phys(void)
+{
+    pt_pool_page_t *node = pool_get_node(PTBLK_PTR);
+    return pool_alloc_block_from_node(node, PTBLK_PTR);
+}
+
+phys_bytes pt_alloc_page_table_phys(void)
+{
+    pt_pool_page_t *node = pool_get_node(PTBLK_PAGE);
+    return pool_alloc_block_from_node(node, PTBLK_PAGE);
+}
+
+void pt_free_ptr_table_phys(const phys_bytes pa)
+{
+    pool_free_block_from_node(pa, PTBLK_PTR);
+}
+
+void pt_free_page_table_phys(const phys_bytes pa)
+{
+    pool_free_block_from_node(pa, PTBLK_PAGE);
+}
+
+uint32_t *pt_table_used_map(const phys_bytes pa)
+{
+    const struct pmm_page *pg = pmm_page(pa & PAGE_ADDR_MASK);
+    pt_pool_page_t *node = pg ? pg->owner : NULL;
+    if (!node || pg->type != PMM_PAGE_PT_POOL || (pa & (PGTABLE_SIZE - 1)) != 0) {
+        LOG_E("No pool table at pa=%08lx\n", pa);
+        __builtin_trap();
+    }
+    return &node->used_map[(pa - node->pa) / (32 * sizeof(uint32_t))];
+}
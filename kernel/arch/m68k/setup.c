@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -7,11 +8,15 @@
 #include "asm/sections.h"
 #include "arch/boot.h"
 #include "arch/bootinfo.h"
+#include "kernel/early_alloc.h"
 #include "kernel/mm.h"
 #include "kernel/printk.h"
 
 #include "arch/head.h"
 #include "arch/mm.h"
+#include "arch/mm_bench.h"
+#include "arch/pt_pool.h"
+#include "arch/setup.h"
 
 // filled in by head.S
 unsigned long bi_machtype;
@@ -22,6 +27,26 @@ unsigned long bi_mmutype;
 static bool init_params_inited __initdata = false;
 static struct boot_params params __initdata = { 0 };
 
+// Whether `opt` is one of the space separated words of `cmdline`
+static bool __init cmdline_has(const char *cmdline, const char *opt)
+{
+    while (*cmdline != '\0')
+    {
+        while (*cmdline == ' ')
+            cmdline++;
+
+        size_t i = 0;
+        while (opt[i] != '\0' && cmdline[i] == opt[i])
+            i++;
+        if (opt[i] == '\0' && (cmdline[i] == ' ' || cmdline[i] == '\0'))
+            return true;
+
+        while (*cmdline != ' ' && *cmdline != '\0')
+            cmdline++;
+    }
+    return false;
+}
+
 /*
     head.S has arranged the following:
     - MMU is enabled and we are mapped in at vaddrs
@@ -42,21 +67,32 @@ void __init arch_early_init(void)
     // Set up the `phys_to_virt`/`virt_to_phys` functions
     mm_init_offset();
 
-    // Give PMM the RAM space
-    pmm_init(p->ranges[0].addr, p->ranges[0].size);
+    // "ttmap" puts the direct map on a transparent translation window. It
+    // has to come first, everything after keeps pointers from phys_to_virt.
+    if (cmdline_has(p->cmdline, "ttmap"))
+    {
+        mm_init_linear_tt(p->ranges, p->nranges);
+    }
 
-    // Reserve kernel image + early boot allocations up to availmem
+    // Every memchunk and boot-time reservation goes through the early
+    // allocator. Reserve the kernel image + early boot allocations up to
+    // availmem so nothing lands on top of them.
     phys_bytes kbase = virt_to_phys((virt_bytes)(uintptr_t)_start_kernel_image);
     phys_bytes kend  = (phys_bytes)availmem;
-    pmm_reserve_range(kbase, kend - kbase);
+    ea_set_direct_map((phys_bytes)phys_kernel_start, (phys_bytes)init_mapped_size);
+    for (unsigned i = 0; i < p->nranges; i++)
+    {
+        ea_add_memory(p->ranges[i].addr, p->ranges[i].size);
+    }
+    ea_reserve(kbase, kend - kbase);
+
+    // Hand all of it to the PMM, the early allocator is sealed after this
+    pmm_init();
 
     // Build a new kernel page-table tree using PMM (not the boot bump area)
     // `vm_init` must switch SRP to the new tree before returning.
     // Map all of memory for simplicity
-    phys_bytes mem_start = p->ranges[0].addr;
-    phys_bytes mem_size  = p->ranges[0].size;
-    virt_bytes v_base    = phys_to_virt(mem_start);
-    vm_init(mem_start, mem_size, v_base);
+    vm_init(p->ranges, p->nranges);
 
     pmm_print_free_mem();
 
@@ -68,6 +104,20 @@ void __init arch_early_init(void)
         pmm_release_range(old_pt_base, old_pt_end - old_pt_base);
     }
     pmm_print_free_mem();
+
+    pmm_bench();
+    vm_lookup_bench();
+    cache_bench();
+}
+
+void arch_idle(void)
+{
+    // Clear pages for the zero pool and trim the table pool before going
+    // to sleep
+    if (pmm_refill_zero_pool() || pt_pool_trim()) {
+        return;
+    }
+    __asm__ __volatile__ ("stop #0x2700" : : : "cc");
 }
 
 static void __init parse_bootinfo(const struct bi_record *record)
@@ -103,9 +153,17 @@ static void __init parse_bootinfo(const struct bi_record *record)
             break;
         
         case BI_COMMAND_LINE:
-            // strcpy(cmdline, data);
-            LOG("got command line: \"%s\"\n", (char*)data);
+        {
+            const char *cmdline = data;
+            size_t i = 0;
+            for (; i < BOOT_MAX_CMDLINE - 1 && cmdline[i] != '\0'; i++)
+            {
+                params.cmdline[i] = cmdline[i];
+            }
+            params.cmdline[i] = '\0';
+            LOG("got command line: \"%s\"\n", params.cmdline);
             break;
+        }
         default:
             //LOG("unknown tag 0x%04x ignored\n", tag);
         }
@@ -0,0 +1,42 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <form_os/type.h>
+
+#include "arch/mm.h"
+
+/* ------------------ Transparent translation windows ----------------------- */
+
+// Window arithmetic for mm_init_linear_tt(), kept apart from the TTR
+// programming so it builds on the host. Everything works on offsets from
+// the window base, a window or a chunk may end at 4GiB.
+
+phys_bytes tt_overlap(phys_bytes addr, phys_bytes len,
+    phys_bytes base, phys_bytes size, phys_bytes *start)
+{
+    // Clip the range to [0, size) relative to the window
+    phys_bytes lo, hi;
+    if (addr >= base) {
+        lo = addr - base;
+        if (lo >= size) return 0;
+        hi = len > size - lo ? size : lo + len;
+    } else {
+        const phys_bytes below = base - addr;
+        if (len <= below) return 0;
+        lo = 0;
+        hi = len - below > size ? size : len - below;
+    }
+    *start = base + lo;
+    return hi - lo;
+}
+
+phys_bytes tt_coverage(const struct mem_range *ranges, unsigned nranges,
+    phys_bytes base, phys_bytes size)
+{
+    phys_bytes covered = 0;
+    for (unsigned r = 0; r < nranges; r++) {
+        phys_bytes start;
+        covered += tt_overlap(ranges[r].addr, ranges[r].size, base, size, &start);
+    }
+    return covered;
+}
@@ -0,0 +1,1016 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <form_os/config.h>
+#include <form_os/type.h>
+
+#include "kernel/mm.h"
+#include "kernel/printk.h"
+#include "arch/cache.h"
+#include "arch/klib.h"
+#include "arch/mm.h"
+#include "arch/pgtable.h"
+#include "arch/pt_pool.h"
+#include "arch/vm.h"
+
+/* -------------------- Virtual Memory Management --------------------------- */
+
+// Building and tearing down 68040 translation trees, installing them in the
+// MMU and keeping the ATC in step with them.
+
+typedef uint32_t desc_t;
+
+static inline desc_t *ptr_table_va_from_desc(desc_t d)
+{
+    phys_bytes table_pa = (phys_bytes)(d & RPTABLE_ALIGN_MASK);
+    return (desc_t*)(uintptr_t)phys_to_virt(table_pa);
+}
+
+static inline desc_t *pg_table_va_from_desc(desc_t d)
+{
+    phys_bytes table_pa = (phys_bytes)(d & PGTABLE_ADDR_MASK);
+    return (desc_t*)(uintptr_t)phys_to_virt(table_pa);
+}
+
+// The user space URP points at. Every other user space has no ATC entries.
+static vm_space_t *g_vm_user;
+
+/* --- Table occupancy --- */
+
+// Every table has a bitmap of the entries in use, kept by the pool (see
+// `pt_table_used_map`). Teardown and unmapping visit only the entries whose
+// bits are set, and a table is empty once its bitmap is.
+
+#define USED_BIT(i)     (0x80000000u >> ((i) % 32))
+
+static inline uint32_t *vm_used_map(const desc_t *table)
+{
+    return pt_table_used_map(virt_to_phys((virt_bytes)(uintptr_t)table));
+}
+
+static inline void used_set(uint32_t *map, uint32_t i)
+{
+    map[i / 32] |= USED_BIT(i);
+}
+
+static inline void used_clear(uint32_t *map, uint32_t i)
+{
+    map[i / 32] &= ~USED_BIT(i);
+}
+
+// Set `n` bits from `i` on, a word at a time
+static void used_set_run(uint32_t *map, uint32_t i, uint32_t n)
+{
+    while (n != 0) {
+        const uint32_t bit = i % 32;
+        const uint32_t k = (n < 32 - bit) ? n : 32 - bit;
+        const uint32_t run = (k == 32) ? 0xFFFFFFFFu : ((1u << k) - 1u) << (32 - bit - k);
+        map[i / 32] |= run;
+        i += k;
+        n -= k;
+    }
+}
+
+static inline bool used_none(const uint32_t *map, uint32_t entries)
+{
+    for (uint32_t w = 0; w < entries / 32; w++) {
+        if (map[w] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The first entry in use at or after `i`, `entries` if there's none
+static uint32_t used_next(const uint32_t *map, uint32_t entries, uint32_t i)
+{
+    while (i < entries) {
+        const uint32_t bits = map[i / 32] & (0xFFFFFFFFu >> (i % 32));
+        if (bits != 0) {
+            return (i & ~31u) + (uint32_t)__builtin_clz(bits);
+        }
+        i = (i & ~31u) + 32;
+    }
+    return entries;
+}
+
+#define for_each_used(i, map, entries) \
+    for (uint32_t i = used_next(map, entries, 0); i < (entries); i = used_next(map, entries, i + 1))
+
+/* --- Table coherence --- */
+
+// Table walks read memory, not the data cache. Descriptors written through
+// a copy-back mapping are pushed before the MMU can look for them, i.e.
+// before the flush that drops the old ATC entries. Freshly allocated tables
+// are cleared with MOVE16, which leaves no cache lines behind.
+static inline void vm_table_sync(const desc_t *d, uint32_t n)
+{
+#if CONFIG_CACHE_COPYBACK
+    cache_flush_range(virt_to_phys((virt_bytes)(uintptr_t)d), n * sizeof(desc_t));
+#else
+    (void)d;
+    (void)n;
+#endif
+}
+
+static desc_t *vm_ensure_ptr_table(vm_space_t *as, virt_bytes va)
+{
+    desc_t *root = (desc_t*)(uintptr_t)phys_to_virt(as->root_pa);
+    const uint32_t ri = ROOT_INDEX(va);
+
+    desc_t d = root[ri];
+    if (!desc_is_table(d)) {
+        LOG_T("requesting new pointer table...\n");
+        phys_bytes pa = pt_alloc_ptr_table_phys();
+
+        // Root/pointer tables are 512 bytes, require bits 8..0 == 0.
+        if ((pa & ~RPTABLE_ALIGN_MASK) != 0)
+        {
+            LOG_E("table is not aligned! (%08lx)\n", pa);
+            __builtin_trap();
+        }
+
+        root[ri] = mk_ptr_table_desc((uint32_t)pa, PTE_ACCESSED);
+        used_set(vm_used_map(root), ri);
+        vm_table_sync(&root[ri], 1);
+        d = root[ri];
+    }
+    return ptr_table_va_from_desc(d);
+}
+
+static desc_t *vm_ensure_page_table(vm_space_t *as, virt_bytes va)
+{
+    desc_t *ptr = vm_ensure_ptr_table(as, va);
+    const uint32_t pi = PTR_INDEX(va);
+
+    desc_t d = ptr[pi];
+    if (!desc_is_table(d)) {
+        LOG_T("(%08lx) %d requesting new page table...\n", d, desc_is_table(d));
+        phys_bytes pa = pt_alloc_page_table_phys();
+
+        // Page tables must be aligned to their size, PGTABLE_SIZE.
+        if ((pa & ~PGTABLE_ALIGN_MASK) != 0)
+        {
+            LOG_E("page table is not aligned! (%08lx)\n", pa);
+            __builtin_trap();
+        }
+
+        ptr[pi] = mk_pg_table_desc((uint32_t)pa, PTE_ACCESSED);
+        used_set(vm_used_map(ptr), pi);
+        vm_table_sync(&ptr[pi], 1);
+        d = ptr[pi];
+    }
+    return pg_table_va_from_desc(d);
+}
+
+// Pages in `len` bytes at `va`, which has to be page-aligned. The range may
+// end at the top of the address space but not wrap around it.
+static uint32_t vm_range_pages(virt_bytes va, size_t len)
+{
+    if ((va & (PAGE_SIZE - 1u)) != 0u) {
+        LOG_E("Virtual address not aligned!\n");
+        __builtin_trap();
+    }
+
+    const uint32_t npages = (uint32_t)((len + (PAGE_SIZE - 1)) / PAGE_SIZE);
+    if (npages != 0 && va + (npages - 1) * PAGE_SIZE < va) {
+        LOG_E("Range wraps around the address space!\n");
+        __builtin_trap();
+    }
+    return npages;
+}
+
+/*
+ * Map `len` bytes, rounded up to whole pages, of physically contiguous memory.
+ *
+ * - `as` gives the root table
+ * - `va` and `pa` must be page-aligned
+ * - `pte_flags` is attributes only (no DESC_TYPE_* bits)
+ *
+ * The tables are walked once per page table, whose entries are then filled
+ * in one go.
+ */
+void vm_space_map_range(vm_space_t *as, virt_bytes va, phys_bytes pa, size_t len, uint32_t pte_flags)
+{
+    LOG_T("as->root_pa=%08lx va=%08lx pa=%08lx len=%08lx flags=%08lx\n",
+        as->root_pa,
+        va,
+        pa,
+        (uint32_t)len,
+        pte_flags);
+
+    if ((pa & (PAGE_SIZE - 1u)) != 0u) {
+        LOG_E("Physical address not aligned!\n");
+        __builtin_trap();
+    }
+
+    uint32_t npages = vm_range_pages(va, len);
+    if (npages == 0) {
+        return;
+    }
+    const uint32_t last = (npages - 1) * PAGE_SIZE;
+    if (pa + last < pa) {
+        LOG_E("Range wraps around the address space!\n");
+        __builtin_trap();
+    }
+
+    desc_t desc = mk_page_desc((uint32_t)pa, pte_flags);
+    while (npages != 0) {
+        desc_t *page = vm_ensure_page_table(as, va);
+        uint32_t i = PAGE_INDEX(va);
+        const uint32_t n = (npages < PAGE_ENTRIES - i) ? npages : PAGE_ENTRIES - i;
+
+        //TODO: decide policy:
+        //        - trap on conflict
+        //        - allow identical remap
+        //        - allow overwrite?
+        for (const uint32_t end = i + n; i < end; i++) {
+            if (page[i] != 0) {
+                LOG_E("PTE for %08lx already in use! %08lx\n",
+                    va + (i - PAGE_INDEX(va)) * PAGE_SIZE, (uint32_t)page[i]);
+                __builtin_trap();
+            }
+            page[i] = desc;
+            desc += PAGE_SIZE;
+        }
+        used_set_run(vm_used_map(page), PAGE_INDEX(va), n);
+        vm_table_sync(&page[PAGE_INDEX(va)], n);
+
+        va += n * PAGE_SIZE;
+        npages -= n;
+    }
+}
+
+// Map one PAGE_SIZE page, same rules as `vm_space_map_range`
+void vm_space_map_page(vm_space_t *as, virt_bytes va, phys_bytes pa, uint32_t pte_flags)
+{
+    vm_space_map_range(as, va, pa, PAGE_SIZE, pte_flags);
+}
+
+void vm_space_init_user(vm_space_t *vm)
+{
+    LOG_T("Requesting new root table...\n");
+
+    vm->root_pa = pt_alloc_ptr_table_phys();
+    vm->supervisor = false;
+    vm->nregions = 0;
+    LOG_T("got 0x%08lx\n", as.root_pa);
+    if ((vm->root_pa & ~RPTABLE_ALIGN_MASK) != 0) {
+        LOG_E("Root table isn't aligned properly!\n");
+        __builtin_trap();
+    }
+}
+
+void vm_space_init_kernel(vm_space_t *vm)
+{
+    vm_space_init_user(vm);
+    vm->supervisor = true;
+}
+
+/* --- Regions --- */
+
+// A space's regions sit in one array sorted by address. Lookups are a
+// binary search, adding or splitting a region shifts the ones above it.
+
+// Index of the first region ending above `va`, `nregions` if there is none
+static uint16_t vm_region_index(const vm_space_t *vm, virt_bytes va)
+{
+    uint16_t lo = 0, hi = vm->nregions;
+    while (lo < hi) {
+        const uint16_t mid = (lo + hi) / 2;
+        if (vm->regions[mid].end <= va) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static struct vm_region *vm_region_find(vm_space_t *vm, virt_bytes va)
+{
+    const uint16_t i = vm_region_index(vm, va);
+    if (i < vm->nregions && vm->regions[i].start <= va) {
+        return &vm->regions[i];
+    }
+    return NULL;
+}
+
+// `vm_region_find` for walks in address order, `*hint` is the last region
+// found and most addresses land in it again
+static const struct vm_region *vm_region_walk(vm_space_t *vm, virt_bytes va, const struct vm_region **hint)
+{
+    const struct vm_region *r = *hint;
+    if (r == NULL || va - r->start >= r->end - r->start) {
+        r = *hint = vm_region_find(vm, va);
+    }
+    return r;
+}
+
+// Are the frames mapped for `r` the space's own?
+static inline bool vm_region_owns(const struct vm_region *r)
+{
+    return r != NULL && r->type == VM_REGION_ANON;
+}
+
+// Returns false if `r` overlaps another region or there's no room for it
+static bool vm_region_insert(vm_space_t *vm, const struct vm_region *r)
+{
+    const uint16_t i = vm_region_index(vm, r->start);
+    if (i < vm->nregions && vm->regions[i].start < r->end) {
+        return false;
+    }
+    if (vm->nregions == CONFIG_VM_SPACE_REGIONS) {
+        LOG_W("No room for another region\n");
+        return false;
+    }
+
+    for (uint16_t j = vm->nregions; j > i; j--) {
+        vm->regions[j] = vm->regions[j - 1];
+    }
+    vm->regions[i] = *r;
+    vm->nregions++;
+    return true;
+}
+
+static bool vm_space_add_region(vm_space_t *vm, virt_bytes va, phys_bytes pa, size_t len,
+    uint32_t pte_flags, enum vm_region_type type)
+{
+    if ((va & (PAGE_SIZE - 1u)) != 0u) {
+        LOG_E("Region start not aligned!\n");
+        __builtin_trap();
+    }
+
+    const virt_bytes end = va + (virt_bytes)((len + (PAGE_SIZE - 1)) & PAGE_ADDR_MASK);
+    if (end <= va) {
+        // Empty, or wraps around the address space
+        return false;
+    }
+
+    const struct vm_region r = {
+        .start = va,
+        .end = end,
+        .pa = pa,
+        .pte_flags = pte_flags,
+        .type = (uint8_t)type,
+    };
+    return vm_region_insert(vm, &r);
+}
+
+bool vm_space_add_anon(vm_space_t *vm, virt_bytes va, size_t len, uint32_t pte_flags)
+{
+    return vm_space_add_region(vm, va, 0, len, pte_flags, VM_REGION_ANON);
+}
+
+bool vm_space_add_phys(vm_space_t *vm, virt_bytes va, phys_bytes pa, size_t len, uint32_t pte_flags)
+{
+    if ((pa & (PAGE_SIZE - 1u)) != 0u) {
+        LOG_E("Physical address not aligned!\n");
+        __builtin_trap();
+    }
+    if (len != 0 && pa + (phys_bytes)(len - 1) < pa) {
+        return false;
+    }
+    return vm_space_add_region(vm, va, pa, len, pte_flags, VM_REGION_PHYS);
+}
+
+/* --- Demand paging --- */
+
+// Give a copy-on-write page its own frame. The last space holding it just
+// takes it over.
+static bool vm_cow_break(desc_t *pte, const struct vm_region *r, virt_bytes va)
+{
+    const phys_bytes pa = (phys_bytes)(*pte & PAGE_ADDR_MASK);
+    struct pmm_page *pg = pmm_page(pa);
+
+    if (pg->refcount == 1) {
+        pg->flags &= ~PMM_PAGE_F_COW;
+        *pte = mk_page_desc((uint32_t)pa, r->pte_flags);
+        return true;
+    }
+
+    const phys_bytes copy = pmm_alloc_page();
+    if (copy == PMM_INVALID_PA) {
+        LOG_W("No memory to copy the page at %08lx\n", va);
+        return false;
+    }
+    copy_lines((void*)(uintptr_t)phys_to_virt(copy), (const void*)(uintptr_t)phys_to_virt(pa), PAGE_SIZE);
+    pmm_page(copy)->type = PMM_PAGE_USER_ANON;
+    *pte = mk_page_desc((uint32_t)copy, r->pte_flags);
+    pmm_page_unref(pa);
+    return true;
+}
+
+bool vm_space_fault(vm_space_t *vm, virt_bytes va, bool write)
+{
+    const struct vm_region *r = vm_region_find(vm, va);
+    if (r == NULL || (write && (r->pte_flags & PTE_RONLY))) {
+        return false;
+    }
+
+    // A missing anonymous page is allocated before any table, so running
+    // out of memory leaves the tables as they were
+    phys_bytes pa = PMM_INVALID_PA;
+    if (r->type != VM_REGION_PHYS && !vm_space_lookup(vm, va, NULL, NULL)) {
+        pa = pmm_alloc_zeroed_page();
+        if (pa == PMM_INVALID_PA) {
+            LOG_W("No memory for the page at %08lx\n", va);
+            return false;
+        }
+        pmm_page(pa)->type = PMM_PAGE_USER_ANON;
+    }
+
+    desc_t *page = vm_ensure_page_table(vm, va);
+    desc_t *pte = &page[PAGE_INDEX(va)];
+    if (!desc_is_page(*pte)) {
+        if (r->type == VM_REGION_PHYS) {
+            pa = r->pa + ((va & PAGE_ADDR_MASK) - r->start);
+        }
+        *pte = mk_page_desc((uint32_t)pa, r->pte_flags);
+        used_set(vm_used_map(page), PAGE_INDEX(va));
+    } else if (write && (*pte & PTE_RONLY) != 0 && (r->flags & VM_REGION_F_COW) != 0) {
+        // Write to a page shared by vm_space_clone
+        if (!vm_cow_break(pte, r, va)) {
+            return false;
+        }
+    }
+
+    // The ATC can hold the invalid descriptor that faulted. A page that was
+    // already there faulted through a stale entry too.
+    vm_table_sync(pte, 1);
+    vm_flush_page(vm, va);
+    return true;
+}
+
+// Drop the frames a page table maps for anonymous regions, before the table
+// goes. Anything else belongs to whoever mapped it.
+static void vm_release_pages(vm_space_t *vm, virt_bytes base, desc_t *page)
+{
+    const struct vm_region *hint = NULL;
+    uint32_t *used = vm_used_map(page);
+    for_each_used(i, used, PAGE_ENTRIES) {
+        if (desc_is_page(page[i]) && vm_region_owns(vm_region_walk(vm, base + i * PAGE_SIZE, &hint))) {
+            pmm_page_unref((phys_bytes)(page[i] & PAGE_ADDR_MASK));
+        }
+        page[i] = 0;
+        used_clear(used, i);
+    }
+}
+
+/*
+ * Make `child` a copy of `parent` that shares all of its pages.
+ *
+ * Anonymous region pages are shared copy-on-write: each gets another
+ * reference and both spaces map it read-only until one of them writes to it.
+ * Other pages aren't the space's own, the child maps them the same way.
+ * Only the page tables are copied.
+ */
+void vm_space_clone(vm_space_t *child, vm_space_t *parent)
+{
+    vm_space_init_user(child);
+    for (uint16_t i = 0; i < parent->nregions; i++) {
+        if (parent->regions[i].type == VM_REGION_ANON) {
+            parent->regions[i].flags |= VM_REGION_F_COW;
+        }
+        child->regions[i] = parent->regions[i];
+    }
+    child->nregions = parent->nregions;
+
+    vm_flush_batch_t batch;
+    vm_flush_batch_init(&batch, parent);
+
+    const struct vm_region *hint = NULL;
+    const desc_t *root = (const desc_t*)(uintptr_t)phys_to_virt(parent->root_pa);
+    for_each_used(ri, vm_used_map(root), ROOT_ENTRIES) {
+        if (!desc_is_table(root[ri])) {
+            continue;
+        }
+        const desc_t *ptr = ptr_table_va_from_desc(root[ri]);
+        for_each_used(pi, vm_used_map(ptr), PTR_ENTRIES) {
+            if (!desc_is_table(ptr[pi])) {
+                continue;
+            }
+            desc_t *page = pg_table_va_from_desc(ptr[pi]);
+            desc_t *copy = NULL;
+            uint32_t *copy_used = NULL;
+            bool shared = false;
+            for_each_used(i, vm_used_map(page), PAGE_ENTRIES) {
+                desc_t d = page[i];
+                if (!desc_is_page(d)) {
+                    continue;
+                }
+
+                const virt_bytes va = (ri << ROOT_INDEX_SHIFT) | (pi << PTR_INDEX_SHIFT) | (i << PAGE_INDEX_SHIFT);
+                if (vm_region_owns(vm_region_walk(parent, va, &hint))) {
+                    const phys_bytes pa = (phys_bytes)(d & PAGE_ADDR_MASK);
+                    pmm_page_ref(pa);
+                    pmm_page(pa)->flags |= PMM_PAGE_F_COW;
+                    if ((d & PTE_RONLY) == 0) {
+                        d |= PTE_RONLY;
+                        page[i] = d;
+                        shared = true;
+                        vm_flush_batch_add(&batch, va);
+                    }
+                }
+
+                if (copy == NULL) {
+                    copy = vm_ensure_page_table(child, va);
+                    copy_used = vm_used_map(copy);
+                }
+                copy[i] = d;
+                used_set(copy_used, i);
+            }
+
+            if (shared) {
+                vm_table_sync(page, PAGE_ENTRIES);
+            }
+            if (copy != NULL) {
+                vm_table_sync(copy, PAGE_ENTRIES);
+            }
+        }
+    }
+
+    // The parent may still have writable entries for what's shared now
+    vm_flush_batch_finish(&batch);
+}
+
+/* --- Unmapping and protecting --- */
+
+// What unmapping lets go of is only released once the ATC entries that
+// could still reach it are flushed. The arrays bound how much is held back.
+#define VM_RECLAIM_FRAMES   32
+#define VM_RECLAIM_TABLES   8
+
+typedef struct {
+    vm_flush_batch_t flush;
+    uint16_t nframes;
+    uint16_t npage_tables;
+    uint16_t nptr_tables;
+    phys_bytes frames[VM_RECLAIM_FRAMES];
+    phys_bytes page_tables[VM_RECLAIM_TABLES];
+    phys_bytes ptr_tables[VM_RECLAIM_TABLES];
+} vm_reclaim_t;
+
+static void vm_reclaim_init(vm_reclaim_t *rc, vm_space_t *vm)
+{
+    vm_flush_batch_init(&rc->flush, vm);
+    rc->nframes = rc->npage_tables = rc->nptr_tables = 0;
+}
+
+// Flush, then release everything collected so far
+static void vm_reclaim_finish(vm_reclaim_t *rc)
+{
+    vm_flush_batch_finish(&rc->flush);
+
+    for (uint16_t i = 0; i < rc->nframes; i++) {
+        pmm_page_unref(rc->frames[i]);
+    }
+    for (uint16_t i = 0; i < rc->npage_tables; i++) {
+        pt_free_page_table_phys(rc->page_tables[i]);
+    }
+    for (uint16_t i = 0; i < rc->nptr_tables; i++) {
+        pt_free_ptr_table_phys(rc->ptr_tables[i]);
+    }
+    rc->nframes = rc->npage_tables = rc->nptr_tables = 0;
+}
+
+static void vm_reclaim_frame(vm_reclaim_t *rc, phys_bytes pa)
+{
+    if (rc->nframes == VM_RECLAIM_FRAMES) {
+        vm_reclaim_finish(rc);
+    }
+    rc->frames[rc->nframes++] = pa;
+}
+
+static void vm_reclaim_page_table(vm_reclaim_t *rc, phys_bytes pa)
+{
+    if (rc->npage_tables == VM_RECLAIM_TABLES) {
+        vm_reclaim_finish(rc);
+    }
+    rc->page_tables[rc->npage_tables++] = pa;
+}
+
+static void vm_reclaim_ptr_table(vm_reclaim_t *rc, phys_bytes pa)
+{
+    if (rc->nptr_tables == VM_RECLAIM_TABLES) {
+        vm_reclaim_finish(rc);
+    }
+    rc->ptr_tables[rc->nptr_tables++] = pa;
+}
+
+
+/*
+ * Rewrite the PTEs of `npages` pages at `va`: remove them when `pte_flags` is
+ * NULL, otherwise give them `*pte_flags`. Region pages that are shared
+ * copy-on-write stay read-only.
+ *
+ * Missing tables are skipped a whole table at a time. Page tables left empty
+ * go back to the pool, and so do the pointer tables they empty.
+ */
+static void vm_rewrite_range(vm_space_t *vm, virt_bytes va, uint32_t npages, const uint32_t *pte_flags)
+{
+    vm_reclaim_t rc;
+    vm_reclaim_init(&rc, vm);
+
+    const struct vm_region *hint = NULL;
+    desc_t *root = (desc_t*)(uintptr_t)phys_to_virt(vm->root_pa);
+    while (npages != 0) {
+        const uint32_t ri = ROOT_INDEX(va);
+        const uint32_t pi = PTR_INDEX(va);
+        const uint32_t first = PAGE_INDEX(va);
+        uint32_t n = PAGE_ENTRIES - first;
+
+        if (!desc_is_table(root[ri])) {
+            // Nothing mapped up to the next pointer table
+            n = ((1u << ROOT_INDEX_SHIFT) - (va & ((1u << ROOT_INDEX_SHIFT) - 1u))) / PAGE_SIZE;
+        }
+        if (n > npages) {
+            n = npages;
+        }
+
+        desc_t *ptr = desc_is_table(root[ri]) ? ptr_table_va_from_desc(root[ri]) : NULL;
+        if (ptr != NULL && desc_is_table(ptr[pi])) {
+            desc_t *page = pg_table_va_from_desc(ptr[pi]);
+            uint32_t *used = vm_used_map(page);
+            bool removed = false, changed = false;
+
+            for (uint32_t i = first; i < first + n; i++) {
+                const desc_t d = page[i];
+                if (!desc_is_page(d)) {
+                    continue;
+                }
+
+                const virt_bytes pva = va + (i - first) * PAGE_SIZE;
+                const phys_bytes pa = (phys_bytes)(d & PAGE_ADDR_MASK);
+                const struct vm_region *r = vm_region_walk(vm, pva, &hint);
+                const bool owned = vm_region_owns(r);
+                desc_t nd = 0;
+                if (pte_flags != NULL) {
+                    nd = mk_page_desc((uint32_t)pa, *pte_flags);
+                    if (owned && (r->flags & VM_REGION_F_COW) != 0
+                        && (pmm_page(pa)->flags & PMM_PAGE_F_COW) != 0) {
+                        nd |= PTE_RONLY;
+                    }
+                    if (nd == d) {
+                        continue;
+                    }
+                } else {
+                    if (owned) {
+                        vm_reclaim_frame(&rc, pa);
+                    }
+                    used_clear(used, i);
+                    removed = true;
+                }
+                page[i] = nd;
+                changed = true;
+                vm_flush_batch_add(&rc.flush, pva);
+            }
+            if (changed) {
+                vm_table_sync(&page[first], n);
+            }
+
+            // A table goes with its last entry, and its parent with it
+            if (removed && used_none(used, PAGE_ENTRIES)) {
+                vm_reclaim_page_table(&rc, (phys_bytes)(ptr[pi] & PGTABLE_ADDR_MASK));
+                ptr[pi] = 0;
+                vm_table_sync(&ptr[pi], 1);
+                uint32_t *ptr_used = vm_used_map(ptr);
+                used_clear(ptr_used, pi);
+                if (used_none(ptr_used, PTR_ENTRIES)) {
+                    vm_reclaim_ptr_table(&rc, (phys_bytes)(root[ri] & RPTABLE_ADDR_MASK));
+                    root[ri] = 0;
+                    vm_table_sync(&root[ri], 1);
+                    used_clear(vm_used_map(root), ri);
+                }
+            }
+        }
+
+        va += n * PAGE_SIZE;
+        npages -= n;
+    }
+
+    vm_reclaim_finish(&rc);
+}
+
+// Whether a region starts inside, not at, `va`
+static bool vm_region_needs_split(vm_space_t *vm, virt_bytes va)
+{
+    const struct vm_region *r = vm_region_find(vm, va);
+    return r != NULL && r->start != va;
+}
+
+// Split the region holding `va`, if any, so that one starts there. The
+// caller has made sure the space has room for the extra region.
+static void vm_region_split(vm_space_t *vm, virt_bytes va)
+{
+    struct vm_region *r = vm_region_find(vm, va);
+    if (r == NULL || r->start == va) {
+        return;
+    }
+
+    struct vm_region tail = *r;
+    tail.start = va;
+    if (tail.type == VM_REGION_PHYS) {
+        tail.pa += va - r->start;
+    }
+    r->end = va;
+    vm_region_insert(vm, &tail);
+}
+
+// The regions inside a range split at both ends: `*first` up to `*last`,
+// exclusive
+static void vm_regions_inside(vm_space_t *vm, virt_bytes va, uint32_t span, uint16_t *first, uint16_t *last)
+{
+    uint16_t i = vm_region_index(vm, va);
+    *first = i;
+    while (i < vm->nregions && vm->regions[i].start - va < span) {
+        i++;
+    }
+    *last = i;
+}
+
+// Make region boundaries of both ends of a range. `end` is 0 at the top
+// of the address space. Returns false, with no region split, if the space
+// has no room for every region that takes.
+static bool vm_region_split_range(vm_space_t *vm, virt_bytes va, virt_bytes end)
+{
+    // Splitting at `va` leaves `end` inside the same region if it was, so
+    // the two counts add up
+    const uint16_t need = vm_region_needs_split(vm, va) + (end != 0 && vm_region_needs_split(vm, end));
+    if (need > CONFIG_VM_SPACE_REGIONS - vm->nregions) {
+        LOG_W("No room to split regions at %08lx-%08lx\n", va, end);
+        return false;
+    }
+
+    vm_region_split(vm, va);
+    if (end != 0) {
+        vm_region_split(vm, end);
+    }
+    return true;
+}
+
+bool vm_space_unmap_range(vm_space_t *vm, virt_bytes va, size_t len)
+{
+    const uint32_t npages = vm_range_pages(va, len);
+    if (npages == 0) {
+        return true;
+    }
+    const uint32_t span = npages * PAGE_SIZE;
+    if (!vm_region_split_range(vm, va, va + span)) {
+        return false;
+    }
+
+    // Regions still tell which frames are the space's own
+    vm_rewrite_range(vm, va, npages, NULL);
+
+    uint16_t first, last;
+    vm_regions_inside(vm, va, span, &first, &last);
+    for (uint16_t i = last; i < vm->nregions; i++) {
+        vm->regions[first + (i - last)] = vm->regions[i];
+    }
+    vm->nregions -= last - first;
+    return true;
+}
+
+bool vm_space_protect_range(vm_space_t *vm, virt_bytes va, size_t len, uint32_t pte_flags)
+{
+    const uint32_t npages = vm_range_pages(va, len);
+    if (npages == 0) {
+        return true;
+    }
+    const uint32_t span = npages * PAGE_SIZE;
+    if (!vm_region_split_range(vm, va, va + span)) {
+        return false;
+    }
+
+    uint16_t first, last;
+    vm_regions_inside(vm, va, span, &first, &last);
+    for (uint16_t i = first; i < last; i++) {
+        vm->regions[i].pte_flags = pte_flags;
+    }
+    vm_rewrite_range(vm, va, npages, &pte_flags);
+    return true;
+}
+
+// Clear the VM space, freeing resources associated with it
+// 1. Release the pages faulted into regions and all page tables
+// 2. Release all pointer tables
+// 3. Release the root table
+void vm_space_destroy(vm_space_t *vm)
+{
+    if (vm == NULL || vm->root_pa == 0) {
+        return;
+    }
+
+    // Nothing may walk the tables once they're freed
+    if (vm == g_vm_user) {
+        mmu_flush_user();
+        g_vm_user = NULL;
+    }
+
+    // Only the entries in use are visited: a small process touches a few
+    // of the 128 root entries and a few of each pointer table's 128
+    desc_t *root = (desc_t*)(uintptr_t)phys_to_virt(vm->root_pa);
+    uint32_t *root_used = vm_used_map(root);
+    for_each_used(ri, root_used, ROOT_ENTRIES) {
+        desc_t rd = root[ri];
+        if (desc_is_table(rd)) {
+            phys_bytes ptr_pa = (phys_bytes)(rd & RPTABLE_ADDR_MASK);
+            desc_t *ptr = (desc_t*)(uintptr_t)phys_to_virt(ptr_pa);
+            uint32_t *ptr_used = vm_used_map(ptr);
+
+            for_each_used(pi, ptr_used, PTR_ENTRIES) {
+                desc_t pd = ptr[pi];
+                if (desc_is_table(pd)) {
+                    phys_bytes pg_pa = (phys_bytes)(pd & PGTABLE_ADDR_MASK);
+                    vm_release_pages(vm, (ri << ROOT_INDEX_SHIFT) | (pi << PTR_INDEX_SHIFT),
+                        (desc_t*)(uintptr_t)phys_to_virt(pg_pa));
+                    pt_free_page_table_phys(pg_pa);
+                    ptr[pi] = 0;
+                    used_clear(ptr_used, pi);
+                } else if (desc_is_page(pd)) {
+                    LOG_E("vm_space_destroy: page descriptor at ptr level (ri=%u pi=%u)\n",
+                        (unsigned)ri, (unsigned)pi);
+                }
+            }
+
+            pt_free_ptr_table_phys(ptr_pa);
+            root[ri] = 0;
+            used_clear(root_used, ri);
+        } else if (desc_is_page(rd)) {
+            LOG_E("vm_space_destroy: page descriptor at root level (ri=%u)\n",
+                (unsigned)ri);
+        }
+    }
+
+    pt_free_ptr_table_phys(vm->root_pa);
+    vm->root_pa = 0;
+    vm->nregions = 0;
+}
+
+/* --- Installing spaces and ATC flushes --- */
+
+// The 040 caches are physically tagged, so a new or changed mapping never
+// makes a cache line stale and none of this invalidates them. Table walks
+// read memory though, not the data cache: tables written through a
+// copy-back mapping have to be pushed first. The writers here push what
+// they change (`vm_table_sync`), the kernel space is pushed as a whole when
+// it's installed since head.S built parts of it.
+
+vm_space_t *vm_space_current(void)
+{
+    return g_vm_user;
+}
+
+void vm_space_activate(vm_space_t *vm)
+{
+    if (vm->supervisor) {
+        // The kernel's tables were built through head.S's copy-back mapping
+        cache_push_data();
+        mmu_load_srp(vm->root_pa);
+        mmu_flush_all();
+        return;
+    }
+
+    if (vm == g_vm_user) {
+        return;
+    }
+    mmu_load_urp(vm->root_pa);
+    mmu_flush_user();
+    g_vm_user = vm;
+}
+
+// Does `vm` have entries in the ATC?
+static inline bool vm_space_live(const vm_space_t *vm)
+{
+    return vm->supervisor || vm == g_vm_user;
+}
+
+// Drop all of `vm`'s ATC entries. There is no PFLUSH for supervisor entries
+// only, the kernel space takes everything with it.
+static void vm_flush_space(vm_space_t *vm)
+{
+    if (vm->supervisor) {
+        mmu_flush_all();
+    } else if (vm == g_vm_user) {
+        mmu_flush_user();
+    }
+}
+
+void vm_flush_page(vm_space_t *vm, virt_bytes va)
+{
+    if (vm_space_live(vm)) {
+        mmu_flush_page(va & PAGE_ADDR_MASK, vm->supervisor);
+    }
+}
+
+void vm_flush_range(vm_space_t *vm, virt_bytes va, size_t len)
+{
+    if (len == 0 || !vm_space_live(vm)) {
+        return;
+    }
+
+    const virt_bytes first = va & PAGE_ADDR_MASK;
+    const uint32_t npages = ((va + (uint32_t)len - 1) - first) / PAGE_SIZE + 1;
+    if (npages > CONFIG_VM_FLUSH_PAGES_MAX) {
+        vm_flush_space(vm);
+        return;
+    }
+    for (uint32_t i = 0; i < npages; i++) {
+        mmu_flush_page(first + i * PAGE_SIZE, vm->supervisor);
+    }
+}
+
+void vm_flush_user(void)
+{
+    mmu_flush_user();
+}
+
+void vm_flush_batch_init(vm_flush_batch_t *b, vm_space_t *vm)
+{
+    b->vm = vm;
+    b->npages = 0;
+    b->all = false;
+}
+
+void vm_flush_batch_add(vm_flush_batch_t *b, virt_bytes va)
+{
+    if (b->all || !vm_space_live(b->vm)) {
+        return;
+    }
+    if (b->npages == CONFIG_VM_FLUSH_PAGES_MAX) {
+        b->all = true;
+        return;
+    }
+    b->va[b->npages++] = va & PAGE_ADDR_MASK;
+}
+
+void vm_flush_batch_finish(vm_flush_batch_t *b)
+{
+    if (b->all) {
+        vm_flush_space(b->vm);
+    } else {
+        for (uint16_t i = 0; i < b->npages; i++) {
+            mmu_flush_page(b->va[i], b->vm->supervisor);
+        }
+    }
+    b->npages = 0;
+    b->all = false;
+}
+
+/* --- Lookups --- */
+
+// The walk gives up at the first level that isn't there, each level costs
+// one load. PTESTR does the same search in hardware, and answers from the
+// ATC without a search when the entry is already loaded, but it only sees
+// the installed spaces.
+
+bool vm_space_lookup(const vm_space_t *vm, virt_bytes va, phys_bytes *pa, uint32_t *pte_flags)
+{
+    const desc_t *root = (const desc_t*)(uintptr_t)phys_to_virt(vm->root_pa);
+    const desc_t rd = root[ROOT_INDEX(va)];
+    if (!desc_is_table(rd)) {
+        return false;
+    }
+    const desc_t pd = ptr_table_va_from_desc(rd)[PTR_INDEX(va)];
+    if (!desc_is_table(pd)) {
+        return false;
+    }
+    const desc_t d = pg_table_va_from_desc(pd)[PAGE_INDEX(va)];
+    if (!desc_is_page(d)) {
+        return false;
+    }
+
+    if (pa != NULL) {
+        *pa = (phys_bytes)(d & PAGE_ADDR_MASK) | (va & ~PAGE_ADDR_MASK);
+    }
+    if (pte_flags != NULL) {
+        *pte_flags = d & PTE_ATTR_MASK;
+    }
+    return true;
+}
+
+bool vm_space_lookup_mmu(const vm_space_t *vm, virt_bytes va, phys_bytes *pa, uint32_t *pte_flags)
+{
+    if (!vm_space_live(vm)) {
+        return vm_space_lookup(vm, va, pa, pte_flags);
+    }
+
+    const uint32_t mmusr = mmu_test_read(va, vm->supervisor);
+    if ((mmusr & (MMUSR_TRANSPARENT | MMUSR_BUS_ERROR)) != 0) {
+        // A TTR or a broken table took the search over, the tables still
+        // say what the space maps
+        return vm_space_lookup(vm, va, pa, pte_flags);
+    }
+    if ((mmusr & MMUSR_RESIDENT) == 0) {
+        return false;
+    }
+
+    if (pa != NULL) {
+        *pa = (phys_bytes)(mmusr & PAGE_ADDR_MASK) | (va & ~PAGE_ADDR_MASK);
+    }
+    if (pte_flags != NULL) {
+        *pte_flags = (mmusr & MMUSR_ATTR_MASK) | PTE_ACCESSED;
+    }
+    return true;
+}
@@ -4,8 +4,10 @@
 #include <form_os/type.h>
 
 #include "kernel/early_alloc.h"
+#include "kernel/mm.h"
+#include "kernel/printk.h"
 
-// TODO: Tune this with more thought
+// Initial capacity, the lists grow past this once a direct map is known
 #define MEM_CAP 32
 #define RES_CAP 64
 
@@ -18,11 +20,15 @@ typedef struct _region_list_t {
     region_t *r;
     uint32_t nr;
     uint32_t cap;
+    phys_bytes pa;  // where `r` lives once grown, 0 while it's the static array
 } region_list_t;
 
 typedef struct _ea_state_t {
     region_list_t memory;
     region_list_t reserved;
+    ea_policy_t policy;
+    phys_bytes dmap_base;   // memory reachable through phys_to_virt(),
+    phys_bytes dmap_end;    // used for growing the lists
 } ea_state_t;
 
 static region_t mem_regions[MEM_CAP] = { 0 };
@@ -31,8 +37,12 @@ static region_t res_regions[RES_CAP] = { 0 };
 static ea_state_t state = {
     .memory   = { .r = mem_regions, .nr = 0, .cap = MEM_CAP },
     .reserved = { .r = res_regions, .nr = 0, .cap = RES_CAP },
+    .policy   = EA_TOP_DOWN,
 };
 
+// Set by ea_finalize(), the PMM owns memory after that
+static bool sealed = false;
+
 /* --- helpers --- */
 
 static inline phys_bytes ea_min(phys_bytes a, phys_bytes b) { return a < b ? a : b; }
@@ -56,148 +66,75 @@ static inline phys_bytes align_up(phys_bytes x, phys_bytes align)
     return (x + (align - 1)) & ~(align - 1);
 }
 
-/*
 static inline phys_bytes align_down(phys_bytes x, phys_bytes align)
 {
     if (align == 0) align = 1;
     return x & ~(align - 1);
 }
 
-static inline bool ranges_overlap_or_adjacent(phys_bytes a0, phys_bytes a1,
-                                              phys_bytes b0, phys_bytes b1)
+// Regions never wrap, region_list_add() checks that on the way in
+static inline phys_bytes region_end(const region_t *r)
 {
-    // Treat adjacency as mergeable: [a0,a1) touches [b0,b1) if a1 == b0.
-    return !(a1 < b0 || b1 < a0);
+    return r->base + r->size;
 }
-*/
 
-// Because these are half-open intervals, overlap/adjacency condition is:
-// prev_end >= cur_base
-static inline bool mergeable(phys_bytes prev_base, phys_bytes prev_end,
-                             phys_bytes  cur_base, phys_bytes  cur_end)
+// Move `n` regions from `src` to `dst`, the two may overlap
+static void region_move(region_t *dst, const region_t *src, uint32_t n)
 {
-    (void)prev_base;
-    (void)cur_end;
-    return prev_end >= cur_base;
-}
-
-/* Insert [base,end) into list (base<end), keep sorted and merged */
-static void region_list_insert_merge(region_list_t *l, phys_bytes base, phys_bytes end)
-{
-    // Find insertion index: first region with base > new base
-    uint32_t i = 0;
-    while (i < l->nr && l->r[i].base <= base) {
-        i++;
-    }
-
-    // Ensure capacity for a new entry (worst-case: no merges)
-    if (l->nr >= l->cap) {
-        // Since it's early boot, fail hard.
-        __builtin_trap();
-    }
-
-    // Shift up to make room
-    for (uint32_t j = l->nr; j > i; j--) {
-        l->r[j] = l->r[j - 1];
-    }
-
-    l->r[i].base = base;
-    l->r[i].size = (phys_bytes)(end - base);
-    l->nr++;
-
-    // Merge with neighbors (both directions)
-    // First merge backwards if needed
-    if (i > 0) {
-        uint32_t p = i - 1;
-        phys_bytes p_base = l->r[p].base;
-        phys_bytes p_end;
-        if (add_overflow_phys(p_base, l->r[p].size, &p_end))
-        {
-            __builtin_trap();
-        }
-
-        phys_bytes c_base = l->r[i].base;
-        phys_bytes c_end;
-        if (add_overflow_phys(c_base, l->r[i].size, &c_end))
-        {
-            __builtin_trap();
-        }
-
-        if (mergeable(p_base, p_end, c_base, c_end)) {
-            // Merge current into previous
-            phys_bytes new_base = p_base;
-            phys_bytes new_end  = ea_max(p_end, c_end);
-
-            l->r[p].base = new_base;
-            l->r[p].size = (phys_bytes)(new_end - new_base);
-
-            // Remove current entry i.
-            for (uint32_t j = i; j + 1 < l->nr; j++) {
-                l->r[j] = l->r[j + 1];
-            }
-            l->nr--;
-            i = p;
-        }
+    if (dst < src) {
+        for (uint32_t i = 0; i < n; i++) dst[i] = src[i];
+    } else if (dst > src) {
+        for (uint32_t i = n; i > 0; i--) dst[i - 1] = src[i - 1];
     }
+}
 
-    // Then merge forward repeatedly
-    while (i + 1 < l->nr) {
-        phys_bytes a_base = l->r[i].base;
-        phys_bytes a_end;
-        if (add_overflow_phys(a_base, l->r[i].size, &a_end)) {
-            __builtin_trap();
-        }
-
-        phys_bytes b_base = l->r[i + 1].base;
-        phys_bytes b_end;
-        if (add_overflow_phys(b_base, l->r[i + 1].size, &b_end)) {
-            __builtin_trap();
-        }
-
-        if (!mergeable(a_base, a_end, b_base, b_end)) {
-            break;
-        }
-
-        // Merge b into a
-        phys_bytes new_base = a_base;
-        phys_bytes new_end  = ea_max(a_end, b_end);
-
-        l->r[i].base = new_base;
-        l->r[i].size = (phys_bytes)(new_end - new_base);
+/*
+Binary searches. The lists are sorted and merged, so both the bases and the
+ends of the regions are strictly increasing.
+*/
 
-        // remove i+1
-        for (uint32_t j = i + 1; j + 1 < l->nr; j++) {
-            l->r[j] = l->r[j + 1];
+// First region that ends at or after `addr`
+static uint32_t region_first_end_ge(const region_list_t *l, phys_bytes addr)
+{
+    uint32_t lo = 0, hi = l->nr;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (region_end(&l->r[mid]) < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        l->nr--;
     }
+    return lo;
 }
 
-// Common entry point for adding an interval to a list
-static void region_list_add(region_list_t *l, phys_bytes base, phys_bytes size)
+// First region that starts after `addr`
+static uint32_t region_first_base_gt(const region_list_t *l, phys_bytes addr)
 {
-    if (size == 0) {
-        return;
-    }
-
-    phys_bytes end;
-    if (add_overflow_phys(base, size, &end)) {
-        __builtin_trap();
-    }
-
-    // Reject pathological "wrap to 0" case: size != 0 but end == base implies overflow
-    if (end <= base) {
-        __builtin_trap();
+    uint32_t lo = 0, hi = l->nr;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (l->r[mid].base <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-
-    region_list_insert_merge(l, base, end);
+    return lo;
 }
 
-// Find an allocation of `size` with `align` within [min_addr, max_addr),
-// searching usable memory minus reserved. Returns true on success.
-static bool find_free_range_bottom_up(phys_bytes size, phys_bytes align,
-                                      phys_bytes min_addr, phys_bytes max_addr,
-                                      phys_bytes *out_base)
+/* --- free space search --- */
+
+/*
+Walk the gaps in usable memory minus reserved, restricted to [min_addr,
+max_addr), lowest address first. Both lists are sorted, so the reserved
+cursor only moves forward: one pass is O(memory + reserved).
+Returns true on success and the address chosen by `policy`.
+*/
+static bool find_free_range(ea_policy_t policy,
+                            phys_bytes size, phys_bytes align,
+                            phys_bytes min_addr, phys_bytes max_addr,
+                            phys_bytes *out_base)
 {
     if (size == 0) {
         return false;
@@ -213,87 +150,214 @@ static bool find_free_range_bottom_up(phys_bytes size, phys_bytes align,
         return false;
     }
 
-    // For each usable memory region...
-    for (uint32_t mi = 0; mi < state.memory.nr; mi++) {
-        phys_bytes u_base = state.memory.r[mi].base;
-        phys_bytes u_end;
-        if (add_overflow_phys(u_base, state.memory.r[mi].size, &u_end)) {
-            __builtin_trap();
-        }
+    bool found = false;
+    phys_bytes best = 0;
+    phys_bytes best_gap = 0;
+
+    // Skip the reserved regions that end before the window
+    uint32_t ri = region_first_end_ge(&state.reserved, min_addr);
 
+    for (uint32_t mi = region_first_end_ge(&state.memory, min_addr); mi < state.memory.nr; mi++) {
         // Clamp usable region to requested window
-        phys_bytes w_base = ea_max(u_base, min_addr);
-        phys_bytes w_end  = u_end;
+        phys_bytes w_base = ea_max(state.memory.r[mi].base, min_addr);
+        phys_bytes w_end  = region_end(&state.memory.r[mi]);
 
         if (max_addr != 0) {
+            if (w_base >= max_addr) {
+                break;
+            }
             w_end = ea_min(w_end, max_addr);
         }
 
-        if (w_end <= w_base) {
-            continue;
-        }
-
-        // Sweep reserved regions that intersect [w_base, w_end)
         phys_bytes cursor = w_base;
-
-        for (uint32_t ri = 0; ri < state.reserved.nr; ri++) {
-            phys_bytes r_base = state.reserved.r[ri].base;
-            phys_bytes r_end;
-            if (add_overflow_phys(r_base, state.reserved.r[ri].size, &r_end)) {
-                __builtin_trap();
-            }
-
-            // Skip reserved ranges entirely below our window
-            if (r_end <= cursor) {
-                continue;
+        while (cursor < w_end) {
+            // Reserved regions entirely below the cursor are done with
+            while (ri < state.reserved.nr && region_end(&state.reserved.r[ri]) <= cursor) {
+                ri++;
             }
 
-            // If reserved starts beyond our window end,
-            // we're done for this usable region
-            if (r_base >= w_end) {
-                break;
+            // Gap is [cursor, gap_end)
+            phys_bytes gap_end = w_end;
+            if (ri < state.reserved.nr) {
+                gap_end = ea_min(gap_end, ea_max(state.reserved.r[ri].base, cursor));
             }
 
-            // Gap is [cursor, min(r_base, w_end))
-            phys_bytes gap_end = ea_min(r_base, w_end);
-            if (gap_end > cursor) {
-                phys_bytes cand = align_up(cursor, align);
-                phys_bytes cand_end;
-
-                if (!add_overflow_phys(cand, size, &cand_end) &&
-                    cand >= cursor &&
-                    cand_end <= gap_end)
-                {
-                    *out_base = cand;
-                    return true;
+            if (gap_end > cursor && gap_end - cursor >= size) {
+                const phys_bytes lo = align_up(cursor, align);
+                const phys_bytes hi = align_down(gap_end - size, align);
+
+                if (lo >= cursor && lo <= hi) {
+                    switch (policy) {
+                    case EA_BOTTOM_UP:
+                        *out_base = lo;
+                        return true;
+                    case EA_TOP_DOWN:
+                        // Later gaps are higher, keep the last one
+                        best = hi;
+                        found = true;
+                        break;
+                    case EA_BEST_FIT:
+                        if (!found || gap_end - cursor < best_gap) {
+                            best = lo;
+                            best_gap = gap_end - cursor;
+                            found = true;
+                        }
+                        break;
+                    }
                 }
             }
 
-            // Move cursor past this reserved region (clamped to window)
-            phys_bytes new_cursor = ea_max(cursor, r_end);
-            cursor = new_cursor;
-
-            if (cursor >= w_end) {
+            if (ri >= state.reserved.nr || gap_end >= w_end) {
                 break;
             }
+            // Continue past the reserved region
+            cursor = region_end(&state.reserved.r[ri]);
         }
+    }
 
-        // Tail gap: [cursor, w_end)
-        if (cursor < w_end) {
-            phys_bytes cand = align_up(cursor, align);
-            phys_bytes cand_end;
-
-            if (!add_overflow_phys(cand, size, &cand_end) &&
-                cand >= cursor &&
-                cand_end <= w_end)
-            {
-                *out_base = cand;
-                return true;
-            }
+    if (found) {
+        *out_base = best;
+    }
+    return found;
+}
+
+/* --- list maintenance --- */
+
+static void region_list_add(region_list_t *l, phys_bytes base, phys_bytes size);
+static void region_list_remove(region_list_t *l, phys_bytes base, phys_bytes end);
+
+/*
+Make room for `extra` more entries. Past the static array, lists are moved to
+twice the size in memory the kernel can reach, allocated with the current
+policy. The new array is reserved and the old one, if it was a previous
+grown copy, is released.
+*/
+static void region_list_reserve_slots(region_list_t *l, uint32_t extra)
+{
+    if (l->nr + extra <= l->cap) {
+        return;
+    }
+    if (state.dmap_end == 0) {
+        // Since it's early boot, fail hard.
+        LOG_E("region list full and no direct map to grow into\n");
+        __builtin_trap();
+    }
+
+    // Recording the new array (and maybe splitting around the old one) in
+    // the reserved list needs room of its own first
+    if (l != &state.reserved) {
+        region_list_reserve_slots(&state.reserved, 2);
+    }
+
+    const uint32_t new_cap = l->cap * 2;
+    const phys_bytes bytes = new_cap * sizeof(region_t);
+    phys_bytes new_pa;
+    if (!find_free_range(state.policy, bytes, sizeof(phys_bytes),
+                         state.dmap_base, state.dmap_end, &new_pa)) {
+        LOG_E("no room to grow region list to %lu entries\n", new_cap);
+        __builtin_trap();
+    }
+
+    region_t *new_r = (region_t*)(uintptr_t)phys_to_virt(new_pa);
+    region_move(new_r, l->r, l->nr);
+
+    const phys_bytes old_pa = l->pa;
+    const phys_bytes old_bytes = l->cap * sizeof(region_t);
+    l->r   = new_r;
+    l->cap = new_cap;
+    l->pa  = new_pa;
+
+    // Both fit now, the reserved list either just grew or was made room for
+    region_list_add(&state.reserved, new_pa, bytes);
+    if (old_pa != 0) {
+        region_list_remove(&state.reserved, old_pa, old_pa + old_bytes);
+    }
+}
+
+/*
+Insert [base,end) into list (base<end), keep sorted and merged.
+Growing a list adds to the reserved list, so make room before looking up any
+indices.
+*/
+static void region_list_insert_merge(region_list_t *l, phys_bytes base, phys_bytes end)
+{
+    region_list_reserve_slots(l, 1);
+
+    // Regions [lo, hi) overlap or touch the new one
+    const uint32_t lo = region_first_end_ge(l, base);
+    const uint32_t hi = region_first_base_gt(l, end);
+
+    if (lo == hi) {
+        // Shift up to make room
+        region_move(&l->r[lo + 1], &l->r[lo], l->nr - lo);
+        l->r[lo].base = base;
+        l->r[lo].size = (phys_bytes)(end - base);
+        l->nr++;
+        return;
+    }
+
+    // Merge them all into the first, then close the gap in one move
+    const phys_bytes new_base = ea_min(base, l->r[lo].base);
+    const phys_bytes new_end  = ea_max(end, region_end(&l->r[hi - 1]));
+    l->r[lo].base = new_base;
+    l->r[lo].size = (phys_bytes)(new_end - new_base);
+
+    region_move(&l->r[lo + 1], &l->r[hi], l->nr - hi);
+    l->nr -= hi - lo - 1;
+}
+
+/* Take [base,end) out of the list, splitting a region if needed */
+static void region_list_remove(region_list_t *l, phys_bytes base, phys_bytes end)
+{
+    region_list_reserve_slots(l, 1);
+
+    uint32_t i = region_first_end_ge(l, base + 1);
+
+    while (i < l->nr && l->r[i].base < end) {
+        region_t *r = &l->r[i];
+        const phys_bytes r_end = region_end(r);
+
+        if (r->base < base && r_end > end) {
+            // Punch a hole in the middle
+            region_move(&l->r[i + 1], &l->r[i], l->nr - i);
+            l->nr++;
+            r->size = base - r->base;
+            l->r[i + 1].base = end;
+            l->r[i + 1].size = r_end - end;
+            return;
+        }
+        if (r->base < base) {
+            r->size = base - r->base;       // keep the head
+            i++;
+        } else if (r_end > end) {
+            r->base = end;                  // keep the tail
+            r->size = r_end - end;
+            return;
+        } else {
+            region_move(&l->r[i], &l->r[i + 1], l->nr - i - 1);
+            l->nr--;                        // covered entirely
         }
     }
+}
 
-    return false;
+// Common entry point for adding an interval to a list
+static void region_list_add(region_list_t *l, phys_bytes base, phys_bytes size)
+{
+    if (size == 0) {
+        return;
+    }
+
+    phys_bytes end;
+    if (add_overflow_phys(base, size, &end)) {
+        __builtin_trap();
+    }
+
+    // Reject pathological "wrap to 0" case: size != 0 but end == base implies overflow
+    if (end <= base) {
+        __builtin_trap();
+    }
+
+    region_list_insert_merge(l, base, end);
 }
 
 static void iter_region_list(region_list_t *l, ea_range_cb cb, void *ctx)
@@ -306,10 +370,6 @@ static void iter_region_list(region_list_t *l, ea_range_cb cb, void *ctx)
 
 /* --- Debugging helper --- */
 
-#define DEBUG
-#ifdef DEBUG
-#include "kernel/printk.h"
-
 static inline void ea_print_list(region_list_t *l)
 {
     for (uint32_t i = 0; i < l->nr; i++)
@@ -319,7 +379,7 @@ static inline void ea_print_list(region_list_t *l)
     }
 }
 
-static void ea_print(void)
+void ea_dump(void)
 {
     region_list_t *l;
 
@@ -340,22 +400,39 @@ static void ea_print(void)
     kputchar('\n');
 }
 
-#else
-#define ea_print()
-#endif /* DEBUG */
-
 /* --- Public API --- */
 
+static inline void ea_check_sealed(void)
+{
+    if (sealed) {
+        LOG_E("early allocator used after hand-off\n");
+        __builtin_trap();
+    }
+}
+
+void ea_set_policy(ea_policy_t policy)
+{
+    ea_check_sealed();
+    state.policy = policy;
+}
+
+void ea_set_direct_map(phys_bytes base, phys_bytes size)
+{
+    ea_check_sealed();
+    state.dmap_base = base;
+    state.dmap_end  = base + size;
+}
+
 void ea_add_memory(phys_bytes base, phys_bytes size)
 {
+    ea_check_sealed();
     region_list_add(&state.memory, base, size);
-    ea_print();
 }
 
 void ea_reserve(phys_bytes base, phys_bytes size)
 {
+    ea_check_sealed();
     region_list_add(&state.reserved, base, size);
-    ea_print();
 }
 
 phys_bytes ea_alloc_or_panic(phys_bytes size,
@@ -363,11 +440,16 @@ phys_bytes ea_alloc_or_panic(phys_bytes size,
                      phys_bytes min_addr,
                      phys_bytes max_addr)
 {
+    ea_check_sealed();
+
+    // Reserving the result mustn't have to grow the list, growing allocates
+    region_list_reserve_slots(&state.reserved, 1);
+
     phys_bytes base;
-    if (!find_free_range_bottom_up(size, align, min_addr, max_addr, &base)) {
+    if (!find_free_range(state.policy, size, align, min_addr, max_addr, &base)) {
         LOG_E("failed for size=%08lx align=%08lx min_addr=%08lx max_addr=%08lx\n",
             size, align, min_addr, max_addr);
-        ea_print();
+        ea_dump();
         __builtin_trap();
     }
 
@@ -378,10 +460,18 @@ phys_bytes ea_alloc_or_panic(phys_bytes size,
 
 void ea_for_each_memory(ea_range_cb cb, void *ctx)
 {
+    ea_check_sealed();
     iter_region_list(&state.memory, cb, ctx);
 }
 
 void ea_for_each_reserved(ea_range_cb cb, void *ctx)
 {
+    ea_check_sealed();
     iter_region_list(&state.reserved, cb, ctx);
 }
+
+void ea_finalize(void)
+{
+    ea_check_sealed();
+    sealed = true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+// Free-running tick source for boot-time benchmarks. Polled rather than
+// interrupt driven, so it must be read more often than its 16-bit counter
+// wraps, every ~284ms, to stay accurate.
+
+// (Re)start the clock at zero
+void bench_clock_start(void);
+
+// Ticks elapsed since bench_clock_start()
+uint32_t bench_clock_ticks(void);
+
+// Convert `ticks` spent on `ops` operations to nanoseconds per operation
+uint32_t bench_ns_per_op(uint32_t ticks, uint32_t ops);
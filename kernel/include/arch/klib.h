@@ -1,5 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <form_os/type.h>
+
 extern void* __copy_msg_from_user_begin;
 extern void* __copy_msg_from_user_end;
 extern void* __copy_msg_to_user_begin;
@@ -12,3 +17,55 @@ int copy_message_from_user(const void* user_mbuf, void* dst_kbuf);
 // Copies 64 bytes from kernel buffer to user space.
 // Returns 0 on success, -1 on fault.
 int copy_message_to_user(const void* src_kbuf, void* user_mbuf);
+
+// Clears `len` bytes at `dst` using MOVE16 line bursts.
+// `dst` must be 16-byte aligned and `len` a multiple of 64.
+void zero_lines(void* dst, size_t len);
+
+// Copies `len` bytes from `src` to `dst` using MOVE16 line bursts.
+// Both must be 16-byte aligned and `len` a multiple of 64.
+void copy_lines(void* dst, const void* src, size_t len);
+
+// Drop the ATC entries for the page at `va`, global ones included, from the
+// user or the supervisor side
+void mmu_flush_page(virt_bytes va, bool supervisor);
+
+// Translate `va` through the user or supervisor root table with PTESTR and
+// return MMUSR
+uint32_t mmu_test_read(virt_bytes va, bool supervisor);
+
+// Drop every non-global ATC entry (PFLUSHAN)
+void mmu_flush_user(void);
+
+// Drop every ATC entry (PFLUSHA)
+void mmu_flush_all(void);
+
+// Install a user or supervisor root table, without touching the ATC
+void mmu_load_urp(phys_bytes root);
+void mmu_load_srp(phys_bytes root);
+
+// Write all dirty data cache lines back to memory and invalidate them
+// (CPUSHA DC)
+void cache_push_data(void);
+
+// Push the data cache and invalidate the instruction cache (CPUSHA BC)
+void cache_sync_all(void);
+
+/*
+ * Cache maintenance over the physical range `len` bytes at `pa`, by 16-byte
+ * line (CPUSHL/CINVL) or by 4 KiB page (CPUSHP/CINVP). Every line or page
+ * the range touches is affected as a whole. See arch/cache.h for the
+ * versions that pick the cheapest.
+ */
+
+// Write back and invalidate data cache lines
+void cache_push_lines(phys_bytes pa, size_t len);
+void cache_push_pages(phys_bytes pa, size_t len);
+
+// Invalidate data cache lines without writing them back
+void cache_inval_lines(phys_bytes pa, size_t len);
+void cache_inval_pages(phys_bytes pa, size_t len);
+
+// Push data cache lines and invalidate instruction cache lines
+void cache_sync_lines(phys_bytes pa, size_t len);
+void cache_sync_pages(phys_bytes pa, size_t len);
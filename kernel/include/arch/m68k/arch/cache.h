@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <form_os/type.h>
+
+// 68040 cache maintenance over a physical range. Each picks line, page or
+// whole-cache operations by the size of the range, see
+// CONFIG_CACHE_LINES_MAX and CONFIG_CACHE_PAGES_MAX.
+//
+// The caches are physically tagged, but table walks, instruction fetches
+// and device DMA go to memory around the data cache.
+
+// Write the range back to memory: after writing page tables, before a
+// device reads a buffer
+void cache_flush_range(phys_bytes pa, size_t len);
+
+// Drop the range from the data cache: after a device wrote to it, before
+// reading it. Lines the range only partly covers are written back instead.
+// A long range takes the whole data cache with it, written back, so the
+// buffer must have been flushed before the device started.
+void cache_inval_range(phys_bytes pa, size_t len);
+
+// Make code written to the range visible to instruction fetches
+void icache_sync_range(phys_bytes pa, size_t len);
@@ -1,15 +1,59 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <form_os/type.h>
 
+#include "arch/boot.h"
+
 #define PMM_INVALID_PA  0xFFFFFFFFu
 
+// Largest block pmm_alloc_pages() hands out: 2^10 pages, 1024 * PAGE_SIZE
+#define PMM_MAX_ORDER   10u
+
+// What a page frame is used for, see `struct pmm_page`
+enum pmm_page_type {
+    PMM_PAGE_FREE = 0,
+    PMM_PAGE_KERNEL,        // kernel data, reserved ranges and holes
+    PMM_PAGE_PT_POOL,       // carved up into MMU tables by the pt pool
+    PMM_PAGE_USER_ANON,     // anonymous user memory
+    PMM_PAGE_ZERO,          // all zeros, waiting in the zero pool
+};
+
+// Page flags
+#define PMM_PAGE_F_COW  0x01u   // shared copy-on-write, copy before writing
+
+// One per page frame, indexed by PFN
+struct pmm_page {
+    uint16_t refcount;      // mappings/owners, the page is freed at 0
+    uint8_t  type;          // enum pmm_page_type
+    uint8_t  flags;         // PMM_PAGE_F_*
+    void    *owner;         // for the page's user, e.g. its pt pool node
+};
+
 // Set up the `virt_to_phys()` and `phys_to_virt()` functions
 void mm_init_offset(void);
 
-// Set up physical memory management
-void pmm_init(phys_bytes base, phys_bytes size);
+// Cover as much of `ranges` as one DTT0/ITT0 window can, for supervisor
+// accesses at the physical address. `phys_to_virt()` prefers the window from
+// then on and `vm_init` leaves what it covers out of the page tables. Does
+// nothing if no window fits next to the linear map and DTT1.
+void mm_init_linear_tt(const struct mem_range *ranges, unsigned nranges);
+
+// Bytes of `len` at `addr` inside the window of `size` bytes at `base`, the
+// first of them at `*start`. Either may end at 4GiB, `size` 0 isn't a
+// window. `*start` is left alone when nothing is inside.
+phys_bytes tt_overlap(phys_bytes addr, phys_bytes len,
+    phys_bytes base, phys_bytes size, phys_bytes *start);
+
+// Bytes of `ranges` inside the window of `size` bytes at `base`, as
+// `tt_overlap`
+phys_bytes tt_coverage(const struct mem_range *ranges, unsigned nranges,
+    phys_bytes base, phys_bytes size);
+
+// Set up physical memory management. Takes over all memory and reservations
+// from the early allocator, which is sealed afterwards.
+void pmm_init(void);
 
 // Reserve a region of physical memory
 void pmm_reserve_range(phys_bytes base, phys_bytes size);
@@ -17,8 +61,43 @@ void pmm_reserve_range(phys_bytes base, phys_bytes size);
 // Release a region of physical memory
 void pmm_release_range(phys_bytes base, phys_bytes size);
 
+// Allocate/free one page frame
+phys_bytes pmm_alloc_page(void);
+void pmm_free_page(phys_bytes phys_addr);
+
+// Descriptor for the page frame at `pa`, NULL if the PMM doesn't track it.
+// Pages come out of the allocator with a refcount of 1 and PMM_PAGE_KERNEL.
+struct pmm_page *pmm_page(phys_bytes pa);
+
+// Take another reference to an allocated page
+void pmm_page_ref(phys_bytes pa);
+
+// Drop a reference, the page is freed with the last one.
+// Returns true if the page was freed.
+bool pmm_page_unref(phys_bytes pa);
+
+// Allocate one page that is already cleared. Free it with pmm_free_page().
+phys_bytes pmm_alloc_zeroed_page(void);
+
+// Clear one more page for the zero pool. Meant for the idle loop.
+// Returns false once there is nothing left to do.
+bool pmm_refill_zero_pool(void);
+
+// Allocate/free 2^order physically contiguous pages, aligned to their size.
+// Blocks must be freed with the order they were allocated with.
+phys_bytes pmm_alloc_pages(unsigned order);
+void pmm_free_pages(phys_bytes phys_addr, unsigned order);
+
+// Page counters are kept up to date, this is O(1)
+phys_pages pmm_free_page_count(void);
+
+// Fill in `st`. The free run figures come from a scan of the bitmap, so
+// this costs a pass over it and doesn't belong on a hot path.
+void pmm_get_stats(struct pmm_stats *st);
+
 void pmm_print_free_mem(void);
 
-void vm_init(phys_bytes base, phys_bytes size, virt_bytes load_base);
+// Build the kernel page tables, mapping every range at `phys_to_virt`
+void vm_init(const struct mem_range *ranges, unsigned nranges);
 
 void mm_init(void);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <form_os/config.h>
+
+#if CONFIG_MM_BENCH
+// Boot-time microbenchmarks for the memory managers. They allocate and free
+// real memory, so run them once the linear map covers all of RAM.
+void pmm_bench(void);
+
+// Software table walks against PTESTR, in a user space installed for it
+void vm_lookup_bench(void);
+
+// Store throughput to RAM in the configured cache mode
+void cache_bench(void);
+#else
+static inline void pmm_bench(void) {}
+static inline void vm_lookup_bench(void) {}
+static inline void cache_bench(void) {}
+#endif
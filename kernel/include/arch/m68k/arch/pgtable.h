@@ -1,28 +1,39 @@
 #pragma once
 
+#include <form_os/config.h>
+
 /*
- * 68040 pagetable geometry for 4 KiB pages (3-level):
+ * 68040 pagetable geometry (3-level), for 4 KiB or 8 KiB pages:
  *   Root:    128 entries (512 bytes) -> covers  32 MiB per entry
  *   Pointer: 128 entries (512 bytes) -> covers 256 KiB per entry
- *   Page:     64 entries (256 bytes) -> covers   4 KiB per entry
+ *   Page:     64 entries (256 bytes) -> covers   4 KiB per entry  (4 KiB)
+ *             32 entries (128 bytes) -> covers   8 KiB per entry  (8 KiB)
  *
  * Index bits:
  *   root index: bits 31..25 (7 bits)
  *   ptr  index: bits 24..18 (7 bits)
- *   page index: bits 17..12 (6 bits)
+ *   page index: bits 17..12 (6 bits)  (4 KiB)
+ *               bits 17..13 (5 bits)  (8 KiB)
  */
 
-#define PAGE_SHIFT          12u
-//#define PAGE_SIZE           (1u << PAGE_SHIFT)
+#define PAGE_SHIFT          CONFIG_PAGE_SHIFT
 #define PAGE_MASK           (~(PAGE_SIZE - 1u))
 
 #define ROOT_ENTRIES        128u
 #define PTR_ENTRIES         128u
-#define PAGE_ENTRIES        64u
+#define PAGE_ENTRIES        (1u << (PTR_INDEX_SHIFT - PAGE_SHIFT))
 
 #define ROOT_INDEX_SHIFT    25u
 #define PTR_INDEX_SHIFT     18u
-#define PAGE_INDEX_SHIFT    12u
+#define PAGE_INDEX_SHIFT    PAGE_SHIFT
+
+// Table sizes in bytes
+#define RPTABLE_SIZE        512u
+#define PGTABLE_SIZE        (PAGE_ENTRIES * 4u)
+
+#if CONFIG_PAGE_SHIFT != 12 && CONFIG_PAGE_SHIFT != 13
+#error "The 68040 MMU only does 4 KiB and 8 KiB pages"
+#endif
 
 /*
  * Descriptor type (low two bits).
@@ -63,14 +74,14 @@
  * using these masks also clears the low "state/type" bits when extracting.
  *
  * - Root/Pointer tables: must be 512-byte aligned
- * - Page tables: must be 256-byte aligned
+ * - Page tables: must be aligned to their size, 256 or 128 bytes
  */
-#define RPTABLE_ALIGN_MASK  0xFFFFFE00u
-#define PGTABLE_ALIGN_MASK  0xFFFFFF00u
+#define RPTABLE_ALIGN_MASK  (~(RPTABLE_SIZE - 1u))
+#define PGTABLE_ALIGN_MASK  (~(PGTABLE_SIZE - 1u))
 
-#define RPTABLE_ADDR_MASK   0xFFFFFE00u
-#define PGTABLE_ADDR_MASK   0xFFFFFF00u
-#define PAGE_ADDR_MASK      0xFFFFF000u
+#define RPTABLE_ADDR_MASK   RPTABLE_ALIGN_MASK
+#define PGTABLE_ADDR_MASK   PGTABLE_ALIGN_MASK
+#define PAGE_ADDR_MASK      (~(PAGE_SIZE - 1u))
 
 /*
  * Common attribute bits (68040)
@@ -82,6 +93,9 @@
 #define PTE_SUPERVISOR      0x00000080u /* supervisor only */
 #define PTE_GLOBAL          0x00000400u /* global */
 
+/* Everything in a page descriptor below the address but the type */
+#define PTE_ATTR_MASK       0x000007FCu
+
 /* 
  * Cache mode field
  */
@@ -93,11 +107,42 @@
 #define PTE_CACHE_NC_SER    (0x2u << PTE_CACHEMODE_SHIFT) /* non-cache, serialized */
 #define PTE_CACHE_NC        (0x3u << PTE_CACHEMODE_SHIFT) /* non-cache, non-serialized */
 
-#define KERNEL_PTE_FLAGS    (PTE_SUPERVISOR | PTE_GLOBAL | PTE_ACCESSED | PTE_DIRTY | PTE_CACHE_WT)
-#define KERNEL_RO_FLAGS     (PTE_SUPERVISOR | PTE_GLOBAL | PTE_ACCESSED | PTE_RONLY | PTE_CACHE_WT)
+/* Cache mode for ordinary RAM, kernel and user alike */
+#if CONFIG_CACHE_COPYBACK
+#define PTE_CACHE_RAM       PTE_CACHE_CB
+#else
+#define PTE_CACHE_RAM       PTE_CACHE_WT
+#endif
+
+/*
+ * MMU status register, as PTESTR leaves it
+ *
+ * The attribute bits sit where they do in a page descriptor, less the used
+ * bit, which the table search has just set anyway.
+ */
+#define MMUSR_RESIDENT      0x00000001u
+#define MMUSR_TRANSPARENT   0x00000002u /* a TTR matched, the rest is void */
+#define MMUSR_BUS_ERROR     0x00000800u /* the table search hit a bus error */
+#define MMUSR_ATTR_MASK     0x000007F4u
+
+/*
+ * Transparent translation registers (ITTx/DTTx)
+ *
+ * A TTR maps logical == physical for every address whose top byte matches
+ * the base under the mask, so windows are 16 MiB aligned powers of two. The
+ * cache mode field is laid out like the PTE one.
+ */
+#define TTR_BASE_MASK       0xFF000000u
+#define TTR_ADDR_MASK_SHIFT 8u          /* mask bits 23..16 ignore bits 31..24 */
+#define TTR_ENABLE          0x00008000u
+#define TTR_SUPERVISOR      0x00002000u /* match supervisor accesses only */
+#define TTR_GRANULE         0x01000000u
+
+#define KERNEL_PTE_FLAGS    (PTE_SUPERVISOR | PTE_GLOBAL | PTE_ACCESSED | PTE_DIRTY | PTE_CACHE_RAM)
+#define KERNEL_RO_FLAGS     (PTE_SUPERVISOR | PTE_GLOBAL | PTE_ACCESSED | PTE_RONLY | PTE_CACHE_RAM)
 
-#define USER_PTE_FLAGS      (PTE_ACCESSED | PTE_DIRTY | PTE_CACHE_WT)
-#define USER_RO_FLAGS       (PTE_ACCESSED | PTE_RONLY | PTE_CACHE_WT)
+#define USER_PTE_FLAGS      (PTE_ACCESSED | PTE_DIRTY | PTE_CACHE_RAM)
+#define USER_RO_FLAGS       (PTE_ACCESSED | PTE_RONLY | PTE_CACHE_RAM)
 
 #ifndef __ASSEMBLER__
 
@@ -122,13 +167,13 @@ static inline uint32_t mk_ptr_table_desc(uint32_t table_pa, uint32_t table_flags
 
 static inline uint32_t mk_pg_table_desc(uint32_t table_pa, uint32_t table_flags)
 {
-    /* table_pa must have bits 7..0 = 0 (256 alignment) */
+    /* table_pa must be aligned to PGTABLE_SIZE */
     return (table_pa & PGTABLE_ADDR_MASK) | DESC_TYPE_TABLE | (table_flags & ~DESC_TYPE_MASK);
 }
 
 static inline uint32_t mk_page_desc(uint32_t page_pa, uint32_t pte_flags)
 {
-    /* page_pa must be 4KiB aligned */
+    /* page_pa must be page aligned */
     return (page_pa & PAGE_ADDR_MASK) | DESC_TYPE_PAGE | (pte_flags & ~DESC_TYPE_MASK);
 }
 
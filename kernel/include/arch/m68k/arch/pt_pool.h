@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <form_os/type.h>
+
+// MMU table allocation. Tables come back zeroed.
+
+// Root and pointer tables (RPTABLE_SIZE, 512 bytes)
+phys_bytes pt_alloc_ptr_table_phys(void);
+void pt_free_ptr_table_phys(const phys_bytes pa);
+
+// Page tables (PGTABLE_SIZE, 256 or 128 bytes)
+phys_bytes pt_alloc_page_table_phys(void);
+void pt_free_page_table_phys(const phys_bytes pa);
+
+// Which entries of the table at `pa` are in use: bit i, MSB first within
+// each 32-bit word, stands for entry i. Cleared when the table is allocated,
+// kept up to date by whoever writes the table.
+uint32_t *pt_table_used_map(const phys_bytes pa);
+
+// Give one surplus empty pool page back to the PMM, for the idle loop.
+// Returns false when there was nothing to release.
+bool pt_pool_trim(void);
+
+void print_ptpool(void);
@@ -94,6 +94,17 @@ typedef struct {
 
 } UART68681_t;
 
+/* Auxiliary Control Register */
+#define ACR_BRG_SET2            0x80    // Baud rate generator set select
+#define ACR_CT_COUNTER_X1_16    0x30    // Counter mode, X1/CLK divided by 16
+
+// The ACR is write-only, so the baud rate set the boot monitor picked has to
+// be known up front to touch the counter/timer without breaking the console.
+#define DUART_ACR_BRG           ACR_BRG_SET2
+
+// Crystal on X1/X2
+#define DUART_X1_HZ             3686400u
+
 #define UART_BASE ((uint32_t)0x20000000)
 #define uart ((UART68681_t *)UART_BASE)
 
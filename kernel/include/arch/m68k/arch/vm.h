@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <form_os/config.h>
+#include <form_os/type.h>
+
+#include "kernel/mm.h"
+
+// What backs a region's pages
+enum vm_region_type {
+    VM_REGION_ANON,         // zero-filled frames of the space's own
+    VM_REGION_PHYS,         // fixed physical memory, owned elsewhere
+};
+
+// Region flags
+#define VM_REGION_F_COW     0x01u   // pages may be shared copy-on-write
+
+// A range of a space's addresses, mapped page by page on first touch
+struct vm_region {
+    virt_bytes start;
+    virt_bytes end;         // exclusive
+    phys_bytes pa;          // VM_REGION_PHYS: the frame at `start`
+    uint32_t pte_flags;     // protection and cache mode of its pages
+    uint8_t type;           // enum vm_region_type
+    uint8_t flags;          // VM_REGION_F_*
+};
+
+struct vm_space {
+    phys_bytes root_pa; // physical address of root table
+    bool supervisor;    // installed in SRP rather than URP
+    uint16_t nregions;
+    struct vm_region regions[CONFIG_VM_SPACE_REGIONS]; // sorted, disjoint
+};
+
+// Pages whose ATC entries are dropped together once the tables are updated
+struct vm_flush_batch {
+    vm_space_t *vm;
+    uint16_t npages;
+    bool all;           // too many pages, drop the whole space instead
+    virt_bytes va[CONFIG_VM_FLUSH_PAGES_MAX];
+};
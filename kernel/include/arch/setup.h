@@ -3,3 +3,7 @@
 // Called extremely early from start_kernel
 // Seeds early allocator with memory regions
 void arch_early_init(void);
+
+// Called from the kernel's idle loop, does background work and then waits
+// for something to happen
+void arch_idle(void);
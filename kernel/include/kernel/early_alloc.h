@@ -2,6 +2,19 @@
 
 #include <form_os/type.h>
 
+// Where ea_alloc_or_panic() places allocations in the free space
+typedef enum {
+    EA_TOP_DOWN,    // highest fit, keeps low memory free (default)
+    EA_BOTTOM_UP,   // lowest fit
+    EA_BEST_FIT,    // lowest address in the smallest gap that fits
+} ea_policy_t;
+
+void ea_set_policy(ea_policy_t policy);
+
+// Memory reachable through phys_to_virt() right now. The region lists start
+// out fixed size and can only grow once this is set.
+void ea_set_direct_map(phys_bytes base, phys_bytes size);
+
 // Add usable memory to the allocator. Architecture-specific startup code
 // has this responibility.
 void ea_add_memory(phys_bytes base, phys_bytes size);
@@ -13,6 +26,9 @@ void ea_reserve(phys_bytes base, phys_bytes size);
 phys_bytes ea_alloc_or_panic(phys_bytes size, phys_bytes align,
                              phys_bytes min_addr, phys_bytes max_addr);
 
+// Print both region lists
+void ea_dump(void);
+
 /* --- For handing off to a real allocator --- */
 
 typedef void (*ea_range_cb)(phys_bytes base, phys_bytes size, void *ctx);
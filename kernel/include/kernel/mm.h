@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include <form_os/type.h>
 
 phys_bytes virt_to_phys(virt_bytes va);
@@ -15,9 +18,84 @@ typedef struct vm_space vm_space_t;
 // Initialize a VM space for a process
 void vm_space_init_user(vm_space_t *vm);
 
+// Initialize the kernel's VM space
+void vm_space_init_kernel(vm_space_t *vm);
+
+// Install a VM space in the MMU. Switching user spaces only drops non-global
+// ATC entries, the kernel's stay.
+void vm_space_activate(vm_space_t *vm);
+
 // Map one page of memory into a VM space
 // TODO: `pte_flags` should probably be generic as well
 void vm_space_map_page(vm_space_t *vm, virt_bytes va, phys_bytes pa, uint32_t pte_flags);
 
+// Map `len` bytes of physically contiguous memory, rounded up to whole pages
+void vm_space_map_range(vm_space_t *vm, virt_bytes va, phys_bytes pa, size_t len, uint32_t pte_flags);
+
 // Clear a VM space
 void vm_space_destroy(vm_space_t *vm);
+
+// Remove the mappings and regions in `len` bytes at `va`, rounded up to
+// whole pages. Anonymous pages are released, page tables left empty go back
+// to the pool. Returns false, with nothing unmapped, if a region would have
+// to be split and the space has no room for the extra one.
+bool vm_space_unmap_range(vm_space_t *vm, virt_bytes va, size_t len);
+
+// Give the mappings and regions in `len` bytes at `va` new `pte_flags`.
+// Pages shared copy-on-write stay read-only until they are written. Fails
+// like `vm_space_unmap_range`.
+bool vm_space_protect_range(vm_space_t *vm, virt_bytes va, size_t len, uint32_t pte_flags);
+
+// Reserve `len` bytes at `va`, rounded up to whole pages, for zero-filled
+// memory. Pages are allocated and mapped as they're first touched, see
+// `vm_space_fault`. Returns false if the range overlaps another region or
+// the space has no room for another one.
+bool vm_space_add_anon(vm_space_t *vm, virt_bytes va, size_t len, uint32_t pte_flags);
+
+// Reserve `len` bytes at `va` for the physical memory at `pa`, mapped page
+// by page as it's touched. The frames stay with whoever owns them. Fails
+// like `vm_space_add_anon`.
+bool vm_space_add_phys(vm_space_t *vm, virt_bytes va, phys_bytes pa, size_t len, uint32_t pte_flags);
+
+// Resolve a fault at `va`. Returns false if the access isn't allowed: no
+// region covers it, it writes a read-only region, or memory ran out.
+bool vm_space_fault(vm_space_t *vm, virt_bytes va, bool write);
+
+// Initialize `child` as a copy-on-write duplicate of `parent`. Only the
+// page tables are copied, pages are copied by the first write to them.
+void vm_space_clone(vm_space_t *child, vm_space_t *parent);
+
+// Translate `va` by walking the space's tables. Returns false if no page is
+// mapped there, otherwise stores the physical address and the mapping's
+// PTE flags (either pointer may be NULL).
+bool vm_space_lookup(const vm_space_t *vm, virt_bytes va, phys_bytes *pa, uint32_t *pte_flags);
+
+// Like `vm_space_lookup`, but asks the MMU when `vm` is installed, which
+// also loads the ATC entry. Other spaces take the table walk.
+bool vm_space_lookup_mmu(const vm_space_t *vm, virt_bytes va, phys_bytes *pa, uint32_t *pte_flags);
+
+// The user space installed in the MMU, NULL before the first switch
+vm_space_t *vm_space_current(void);
+
+/*
+ * ATC flushes, after changing or removing mappings of a VM space.
+ * Flushing a user space that isn't installed is free: its entries went when
+ * it was switched out.
+ */
+void vm_flush_page(vm_space_t *vm, virt_bytes va);
+void vm_flush_range(vm_space_t *vm, virt_bytes va, size_t len);
+
+// Drop every non-global ATC entry, for all user spaces at once
+void vm_flush_user(void);
+
+/*
+ * vm_flush_batch_t:
+ * Collects pages to flush while a range of PTEs is being rewritten, so the
+ * flush happens once at the end. Tables freed along the way must not be
+ * reused before `vm_flush_batch_finish`.
+ */
+typedef struct vm_flush_batch vm_flush_batch_t;
+
+void vm_flush_batch_init(vm_flush_batch_t *b, vm_space_t *vm);
+void vm_flush_batch_add(vm_flush_batch_t *b, virt_bytes va);
+void vm_flush_batch_finish(vm_flush_batch_t *b);
@@ -27,7 +27,7 @@ void __init __attribute__((__noreturn__)) start_kernel(void)
 
     //arch_halt();
     while (1) {
-        __asm__ __volatile__ ("stop #0x2700" : : : "cc");
+        arch_idle();
     }
 
     __builtin_unreachable();
@@ -0,0 +1,317 @@
+// Microbenchmarks for the PMM, the page table pool, page table building and
+// the early allocator.
+// Numbers are host ns/op: good for comparing two versions of an allocator,
+// not for predicting 68040 timings.
+
+#include <string.h>
+
+#include "kernel/early_alloc.h"
+#include "arch/boot.h"
+#include "arch/mm.h"
+#include "arch/pgtable.h"
+#include "arch/pt_pool.h"
+#include "arch/vm.h"
+
+#include "host.h"
+
+#define ARENA_SIZE  (64u << 20)
+#define ARENA_ALIGN (4u << 20)
+
+#define BENCH_OPS   1024u
+#define BENCH_REPS  64u
+
+static phys_bytes g_pages[ARENA_SIZE / PAGE_SIZE];
+
+static void setup(void)
+{
+    arena_init(ARENA_SIZE, ARENA_ALIGN);
+    static struct mem_range r;
+    r = (struct mem_range){ arena_base, ARENA_SIZE };
+    boot_mm(&r, 1);
+}
+
+/* --- fragmentation patterns --- */
+
+// Decide which pages stay allocated, `i` of `n` in address order
+typedef bool (*keep_fn)(size_t i);
+
+static bool keep_none(size_t i)    { (void)i; return false; }
+static bool keep_every_2nd(size_t i) { return (i & 1) == 0; }
+static bool keep_50(size_t i)      { (void)i; return rng_below(100) < 50; }
+static bool keep_90(size_t i)      { (void)i; return rng_below(100) < 90; }
+static bool keep_runs(size_t i)    { return (i & 63) < 48; }  // 16-page holes
+
+static const struct {
+    const char *name;
+    keep_fn keep;
+} patterns[] = {
+    { "empty",        keep_none },
+    { "checkerboard", keep_every_2nd },
+    { "random-50%",   keep_50 },
+    { "random-90%",   keep_90 },
+    { "holes-16",     keep_runs },
+};
+
+static size_t g_pattern;
+
+// Take every page, then give back the ones the pattern doesn't keep
+static void fragment(void)
+{
+    size_t n = 0;
+    for (phys_bytes pa; (pa = pmm_alloc_page()) != PMM_INVALID_PA; ) {
+        g_pages[n++] = pa;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!patterns[g_pattern].keep(i)) {
+            pmm_free_page(g_pages[i]);
+        }
+    }
+}
+
+// Failed allocations count as operations for the alloc column, a failed
+// search costs time too
+static void report(const char *op, uint64_t alloc_ns, uint64_t free_ns, uint64_t ops, uint64_t fails)
+{
+    printf("%-14s %-18s %9.1f %9.1f", patterns[g_pattern].name, op,
+        (double)alloc_ns / (double)(ops + fails),
+        ops ? (double)free_ns / (double)ops : 0.0);
+    if (fails) printf("   (%llu failed)", (unsigned long long)fails);
+    putchar('\n');
+}
+
+/* --- benchmarks --- */
+
+static void bench_pages(unsigned order)
+{
+    setup();
+    fragment();
+
+    static phys_bytes held[BENCH_OPS];
+    uint64_t alloc_ns = 0, free_ns = 0, ops = 0, fails = 0;
+
+    for (unsigned rep = 0; rep < BENCH_REPS; rep++) {
+        size_t n = 0;
+        uint64_t t0 = now_ns();
+        for (unsigned i = 0; i < BENCH_OPS; i++) {
+            const phys_bytes pa = order ? pmm_alloc_pages(order) : pmm_alloc_page();
+            if (pa == PMM_INVALID_PA) {
+                fails++;
+                continue;
+            }
+            held[n++] = pa;
+        }
+        uint64_t t1 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            if (order) {
+                pmm_free_pages(held[i], order);
+            } else {
+                pmm_free_page(held[i]);
+            }
+        }
+        uint64_t t2 = now_ns();
+
+        alloc_ns += t1 - t0;
+        free_ns  += t2 - t1;
+        ops      += n;
+    }
+
+    char op[32];
+    snprintf(op, sizeof(op), order ? "pmm_alloc_pages(%u)" : "pmm_alloc_page", order);
+    report(op, alloc_ns, free_ns, ops, fails);
+}
+
+static void bench_page(void)    { bench_pages(0); }
+static void bench_order2(void)  { bench_pages(2); }
+static void bench_order5(void)  { bench_pages(5); }
+
+static void bench_pt_pool(void)
+{
+    setup();
+    fragment();
+
+    static phys_bytes held[BENCH_OPS];
+    uint64_t alloc_ns = 0, free_ns = 0, ops = 0;
+
+    for (unsigned rep = 0; rep < BENCH_REPS; rep++) {
+        uint64_t t0 = now_ns();
+        for (unsigned i = 0; i < BENCH_OPS; i++) {
+            held[i] = pt_alloc_page_table_phys();
+        }
+        uint64_t t1 = now_ns();
+        // Free in a scattered order, like tearing down an address space
+        for (unsigned i = 0; i < BENCH_OPS; i++) {
+            pt_free_page_table_phys(held[(i * 7u) % BENCH_OPS]);
+        }
+        uint64_t t2 = now_ns();
+
+        alloc_ns += t1 - t0;
+        free_ns  += t2 - t1;
+        ops      += BENCH_OPS;
+    }
+    report("pt_alloc_page", alloc_ns, free_ns, ops, 0);
+}
+
+/*
+Address space teardown: every space has a root table, a couple of pointer
+tables and a handful of page tables. All of them are built, then torn down
+one space at a time, the way vm_space_destroy() frees them.
+*/
+#define TD_SPACES   40u
+#define TD_PTRS     2u
+#define TD_PAGES    8u
+
+static void bench_pt_teardown(void)
+{
+    setup();
+    fragment();
+
+    static phys_bytes big[TD_SPACES][1 + TD_PTRS];
+    static phys_bytes small[TD_SPACES][TD_PAGES];
+    const uint64_t per_space = 1 + TD_PTRS + TD_PAGES;
+    uint64_t alloc_ns = 0, free_ns = 0, ops = 0;
+
+    for (unsigned rep = 0; rep < BENCH_REPS; rep++) {
+        uint64_t t0 = now_ns();
+        for (unsigned s = 0; s < TD_SPACES; s++) {
+            for (unsigned i = 0; i < 1 + TD_PTRS; i++) big[s][i] = pt_alloc_ptr_table_phys();
+            for (unsigned i = 0; i < TD_PAGES; i++)    small[s][i] = pt_alloc_page_table_phys();
+        }
+        uint64_t t1 = now_ns();
+        for (unsigned k = 0; k < TD_SPACES; k++) {
+            const unsigned s = (k * 7u) % TD_SPACES;
+            for (unsigned i = 0; i < TD_PAGES; i++)    pt_free_page_table_phys(small[s][i]);
+            for (unsigned i = 0; i < 1 + TD_PTRS; i++) pt_free_ptr_table_phys(big[s][TD_PTRS - i]);
+        }
+        uint64_t t2 = now_ns();
+
+        alloc_ns += t1 - t0;
+        free_ns  += t2 - t1;
+        ops      += TD_SPACES * per_space;
+    }
+    report("pt_teardown", alloc_ns, free_ns, ops, 0);
+}
+
+// Map 16MiB the way vm_init() maps RAM, one page at a time and as a range.
+// Tearing the space down is the free column.
+#define MAP_PAGES   ((16u << 20) / PAGE_SIZE)
+
+static void bench_vm_map(bool range)
+{
+    setup();
+    fragment();
+
+    uint64_t alloc_ns = 0, free_ns = 0, ops = 0;
+    for (unsigned rep = 0; rep < BENCH_REPS / 8; rep++) {
+        vm_space_t vm;
+        vm_space_init_user(&vm);
+
+        uint64_t t0 = now_ns();
+        if (range) {
+            vm_space_map_range(&vm, KERNEL_VIRT_BASE, 0, MAP_PAGES * PAGE_SIZE, KERNEL_PTE_FLAGS);
+        } else {
+            for (uint32_t i = 0; i < MAP_PAGES; i++) {
+                vm_space_map_page(&vm, KERNEL_VIRT_BASE + i * PAGE_SIZE, i * PAGE_SIZE, KERNEL_PTE_FLAGS);
+            }
+        }
+        uint64_t t1 = now_ns();
+        vm_space_destroy(&vm);
+        uint64_t t2 = now_ns();
+
+        alloc_ns += t1 - t0;
+        free_ns  += t2 - t1;
+        ops      += MAP_PAGES;
+    }
+    report(range ? "vm_map_range" : "vm_map_page", alloc_ns, free_ns, ops, 0);
+}
+
+static void bench_vm_map_page(void)  { bench_vm_map(false); }
+static void bench_vm_map_range(void) { bench_vm_map(true); }
+
+// A small process: text, heap and stack far apart, a few pages touched in
+// each. Faulting them in is the alloc column, vm_space_destroy() the free
+// column, per page touched.
+#define SMALL_TOUCH 8u
+
+static void bench_vm_small_space(void)
+{
+    setup();
+    fragment();
+
+    static const virt_bytes bases[] = { 0x00400000u, 0x10000000u, 0x7FF00000u };
+    uint64_t alloc_ns = 0, free_ns = 0, ops = 0;
+    for (unsigned rep = 0; rep < BENCH_REPS; rep++) {
+        vm_space_t vm;
+        vm_space_init_user(&vm);
+
+        uint64_t t0 = now_ns();
+        for (size_t r = 0; r < ARRAY_LEN(bases); r++) {
+            vm_space_add_anon(&vm, bases[r], SMALL_TOUCH * PAGE_SIZE, USER_PTE_FLAGS);
+            for (uint32_t i = 0; i < SMALL_TOUCH; i++) {
+                vm_space_fault(&vm, bases[r] + i * PAGE_SIZE, true);
+            }
+        }
+        uint64_t t1 = now_ns();
+        vm_space_destroy(&vm);
+        uint64_t t2 = now_ns();
+
+        alloc_ns += t1 - t0;
+        free_ns  += t2 - t1;
+        ops      += ARRAY_LEN(bases) * SMALL_TOUCH;
+    }
+    report("vm_small_space", alloc_ns, free_ns, ops, 0);
+}
+
+// The early allocator doesn't depend on the PMM pattern, it runs once
+static void bench_early_alloc(void)
+{
+    // A boot-like layout: a few chunks with reservations scattered through
+    for (unsigned i = 0; i < 4; i++) {
+        ea_add_memory(0x01000000u + (i << 25), 16u << 20);
+    }
+    for (unsigned i = 0; i < 24; i++) {
+        ea_reserve(0x01000000u + rng_below(0x08000000u), 1 + rng_below(0x10000));
+    }
+
+    // Reserved list capacity bounds how many allocations fit
+    enum { NALLOC = 32 };
+    uint64_t t0 = now_ns();
+    for (unsigned i = 0; i < NALLOC; i++) {
+        (void)ea_alloc_or_panic(PAGE_SIZE, PAGE_SIZE, 0, 0);
+    }
+    uint64_t t1 = now_ns();
+
+    printf("%-14s %-18s %9.1f %9s\n", "boot-like", "ea_alloc_or_panic",
+        (double)(t1 - t0) / NALLOC, "-");
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benches[] = {
+    { "pmm_alloc_page",  bench_page },
+    { "pmm_alloc_pages", bench_order2 },
+    { "pmm_alloc_pages", bench_order5 },
+    { "pt_pool",         bench_pt_pool },
+    { "pt_teardown",     bench_pt_teardown },
+    { "vm_map_page",     bench_vm_map_page },
+    { "vm_map_range",    bench_vm_map_range },
+    { "vm_small_space",  bench_vm_small_space },
+};
+
+int main(void)
+{
+    host_verbose = getenv("HOSTTEST_VERBOSE") != NULL;
+
+    printf("%u KiB pages\n", PAGE_SIZE / 1024);
+    printf("%-14s %-18s %9s %9s\n", "pattern", "op", "alloc", "free");
+    printf("%-14s %-18s %9s %9s\n", "", "", "ns/op", "ns/op");
+
+    int failed = 0;
+    for (g_pattern = 0; g_pattern < ARRAY_LEN(patterns); g_pattern++) {
+        for (size_t b = 0; b < ARRAY_LEN(benches); b++) {
+            failed += !run_forked(benches[b].name, benches[b].fn);
+        }
+    }
+    failed += !run_forked("early_alloc", bench_early_alloc);
+    return failed ? 1 : 0;
+}
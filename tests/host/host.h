@@ -0,0 +1,92 @@
+#pragma once
+
+// Shared bits for the host builds of the memory managers. The kernel sources
+// are compiled unchanged, physical memory is a block of host memory below
+// 4GiB so a `virt_bytes` can still hold a pointer into it.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <form_os/config.h>
+#include <form_os/type.h>
+
+#define ARRAY_LEN(x) (sizeof(x) / sizeof((x)[0]))
+
+// Simulated RAM, identity mapped: phys_to_virt(pa) == pa
+extern phys_bytes arena_base;
+extern phys_bytes arena_size;
+
+// Map `size` bytes of simulated RAM, aligned to `align`
+void arena_init(phys_bytes size, phys_bytes align);
+
+static inline void *pa_ptr(phys_bytes pa)
+{
+    return (void*)(uintptr_t)pa;
+}
+
+// Set to make printk/LOG output visible
+extern bool host_verbose;
+
+// xorshift32, the same sequence on every host
+extern uint32_t rng_state;
+static inline uint32_t rng(void)
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+static inline uint32_t rng_below(uint32_t n)
+{
+    return rng() % n;
+}
+
+uint64_t now_ns(void);
+
+// The allocators keep their state in file-scope statics with no way to reset
+// it, so every test case runs in its own child process.
+// Returns true if `fn` exited with 0.
+bool run_forked(const char *name, void (*fn)(void));
+
+// Returns true if `fn` hits a kernel trap (__builtin_trap) in a child process
+bool expect_trap(void (*fn)(void));
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s: ",                \
+                __FILE__, __LINE__, #cond);                             \
+            fprintf(stderr, __VA_ARGS__);                               \
+            fputc('\n', stderr);                                        \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define HOST_CACHE_OPS 256
+
+// What the kernel asked of the MMU, in place of the klib.S primitives
+struct host_mmu {
+    unsigned flush_page;        // mmu_flush_page calls
+    unsigned flush_user;        // PFLUSHAN
+    unsigned flush_all;         // PFLUSHA
+    unsigned cache_push;        // CPUSHA DC
+    unsigned cache_sync;        // CPUSHA BC
+    unsigned ptest;             // PTESTR
+    virt_bytes last_va;         // last page flushed
+    bool last_supervisor;
+    phys_bytes urp, srp;
+    // Line and page operations, the first HOST_CACHE_OPS kept. `op` is
+    // 'p'ush, 'i'nvalidate or 's'ync, capitalized for pages.
+    unsigned ncache_ops;
+    struct { char op; phys_bytes pa; size_t len; } cache_ops[HOST_CACHE_OPS];
+};
+extern struct host_mmu host_mmu;
+
+struct mem_range;
+
+// Hand `ranges` to the early allocator with the first page reserved as a
+// stand-in for the kernel image, then bring up the PMM from it
+void boot_mm(const struct mem_range *ranges, unsigned nranges);
@@ -0,0 +1,233 @@
+// Stand-ins for the parts of the kernel the memory managers call into
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "kernel/early_alloc.h"
+#include "kernel/mm.h"
+#include "kernel/printk.h"
+#include "arch/head.h"
+#include "arch/klib.h"
+#include "arch/mm.h"
+#include "arch/pgtable.h"
+
+#include "host.h"
+
+phys_bytes arena_base;
+phys_bytes arena_size;
+bool host_verbose;
+uint32_t rng_state = 0x2545F491u;
+struct host_mmu host_mmu;
+
+__initdata unsigned long phys_kernel_start;
+__initdata unsigned long init_mapped_size;
+
+void arena_init(phys_bytes size, phys_bytes align)
+{
+    const size_t len = (size_t)size + align;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+    flags |= MAP_32BIT;
+#endif
+#ifdef MAP_POPULATE
+    // Fault it all in now, RAM doesn't get slower the first time it's touched
+    flags |= MAP_POPULATE;
+#endif
+    // Without MAP_32BIT, ask for somewhere low and check what we got
+    void *p = mmap((void*)(uintptr_t)0x10000000u, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED || (uintptr_t)p + len > 0xFFFFFFFFu) {
+        fprintf(stderr, "can't map %zu bytes below 4GiB\n", len);
+        exit(2);
+    }
+
+    arena_base = ((phys_bytes)(uintptr_t)p + (align - 1)) & ~(align - 1);
+    arena_size = size;
+
+    // Allocations from the early allocator have to land in here
+    phys_kernel_start = arena_base;
+    init_mapped_size  = arena_size;
+}
+
+void boot_mm(const struct mem_range *ranges, unsigned nranges)
+{
+    ea_set_direct_map(arena_base, arena_size);
+    for (unsigned i = 0; i < nranges; i++)
+    {
+        ea_add_memory(ranges[i].addr, ranges[i].size);
+    }
+    ea_reserve(ranges[0].addr, PAGE_SIZE);
+
+    pmm_init();
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+bool run_forked(const char *name, void (*fn)(void))
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(2);
+    }
+    if (pid == 0) {
+        fn();
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return true;
+    }
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "%s: killed by signal %d (a kernel trap is SIGILL)\n",
+            name, WTERMSIG(status));
+    }
+    return false;
+}
+
+bool expect_trap(void (*fn)(void))
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(2);
+    }
+    if (pid == 0) {
+        fn();
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGILL;
+}
+
+/* --- kernel interfaces --- */
+
+phys_bytes virt_to_phys(virt_bytes va)
+{
+    return (phys_bytes)va;
+}
+
+virt_bytes phys_to_virt(phys_bytes pa)
+{
+    return (virt_bytes)pa;
+}
+
+int printk(const char *fmt, ...)
+{
+    if (!host_verbose) return 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int kputchar(int ch)
+{
+    return host_verbose ? putchar(ch) : ch;
+}
+
+int snprintf_(char* buffer, size_t count, const char* format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(buffer, count, format, ap);
+    va_end(ap);
+    return n;
+}
+
+void zero_lines(void* dst, size_t len)
+{
+    memset(dst, 0, len);
+}
+
+void copy_lines(void* dst, const void* src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+void mmu_flush_page(virt_bytes va, bool supervisor)
+{
+    host_mmu.flush_page++;
+    host_mmu.last_va = va;
+    host_mmu.last_supervisor = supervisor;
+}
+
+// A table search like the 68040's, through whichever root is loaded
+uint32_t mmu_test_read(virt_bytes va, bool supervisor)
+{
+    host_mmu.ptest++;
+    const uint32_t *root = pa_ptr(supervisor ? host_mmu.srp : host_mmu.urp);
+    const uint32_t rd = root[ROOT_INDEX(va)];
+    if (!desc_is_table(rd)) return 0;
+    const uint32_t pd = ((const uint32_t*)pa_ptr(rd & RPTABLE_ADDR_MASK))[PTR_INDEX(va)];
+    if (!desc_is_table(pd)) return 0;
+    const uint32_t d = ((const uint32_t*)pa_ptr(pd & PGTABLE_ADDR_MASK))[PAGE_INDEX(va)];
+    if (!desc_is_page(d)) return 0;
+    return (d & PAGE_ADDR_MASK) | (d & MMUSR_ATTR_MASK) | MMUSR_RESIDENT;
+}
+
+void mmu_flush_user(void)
+{
+    host_mmu.flush_user++;
+}
+
+void mmu_flush_all(void)
+{
+    host_mmu.flush_all++;
+}
+
+void mmu_load_urp(phys_bytes root)
+{
+    host_mmu.urp = root;
+}
+
+void mmu_load_srp(phys_bytes root)
+{
+    host_mmu.srp = root;
+}
+
+void cache_push_data(void)
+{
+    host_mmu.cache_push++;
+}
+
+void cache_sync_all(void)
+{
+    host_mmu.cache_sync++;
+}
+
+static void cache_op(char op, phys_bytes pa, size_t len)
+{
+    if (host_mmu.ncache_ops < HOST_CACHE_OPS) {
+        host_mmu.cache_ops[host_mmu.ncache_ops].op = op;
+        host_mmu.cache_ops[host_mmu.ncache_ops].pa = pa;
+        host_mmu.cache_ops[host_mmu.ncache_ops].len = len;
+    }
+    host_mmu.ncache_ops++;
+}
+
+void cache_push_lines(phys_bytes pa, size_t len)  { cache_op('p', pa, len); }
+void cache_push_pages(phys_bytes pa, size_t len)  { cache_op('P', pa, len); }
+void cache_inval_lines(phys_bytes pa, size_t len) { cache_op('i', pa, len); }
+void cache_inval_pages(phys_bytes pa, size_t len) { cache_op('I', pa, len); }
+void cache_sync_lines(phys_bytes pa, size_t len)  { cache_op('s', pa, len); }
+void cache_sync_pages(phys_bytes pa, size_t len)  { cache_op('S', pa, len); }
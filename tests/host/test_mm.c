@@ -0,0 +1,1658 @@
+// Randomized correctness tests for the PMM, the page table pool and the
+// early allocator. Each allocator is checked against a simple model.
+
+#include <string.h>
+
+#include <form_os/config.h>
+
+#include "kernel/early_alloc.h"
+#include "arch/boot.h"
+#include "arch/cache.h"
+#include "arch/head.h"
+#include "arch/mm.h"
+#include "arch/pgtable.h"
+#include "arch/pt_pool.h"
+#include "arch/vm.h"
+
+#include "host.h"
+
+#define ARENA_SIZE  (16u << 20)
+#define ARENA_ALIGN (4u << 20)      // room for order 10 blocks
+
+static struct mem_range g_ranges[2];
+static size_t g_npages;             // pages in the arena
+static uint8_t *g_model;            // 1 = free, one per arena page
+
+static inline size_t model_idx(phys_bytes pa)
+{
+    return (pa - arena_base) / PAGE_SIZE;
+}
+
+static inline phys_bytes model_pa(size_t i)
+{
+    return arena_base + (phys_bytes)(i * PAGE_SIZE);
+}
+
+static bool in_ranges(phys_bytes pa)
+{
+    for (size_t i = 0; i < 2; i++) {
+        if (pa >= g_ranges[i].addr && pa - g_ranges[i].addr < g_ranges[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Two chunks with a hole between them, the second one not ending on a
+// word boundary of the bitmap
+static void setup_two_chunks(void)
+{
+    arena_init(ARENA_SIZE, ARENA_ALIGN);
+    g_ranges[0] = (struct mem_range){ arena_base + 0x10000,  0x600000 - 0x10000 };
+    g_ranges[1] = (struct mem_range){ arena_base + 0x800000, 0x800000 - 5 * PAGE_SIZE };
+    boot_mm(g_ranges, 2);
+
+    g_npages = ARENA_SIZE / PAGE_SIZE;
+    g_model = calloc(g_npages, 1);
+    for (size_t i = 0; i < g_npages; i++) {
+        const struct pmm_page *pg = pmm_page(model_pa(i));
+        g_model[i] = pg && pg->type == PMM_PAGE_FREE;
+        if (g_model[i]) {
+            CHECK(in_ranges(model_pa(i)), "free page %08x outside memory", model_pa(i));
+        }
+    }
+}
+
+static void check_against_model(void)
+{
+    size_t nfree = 0;
+    for (size_t i = 0; i < g_npages; i++) {
+        nfree += g_model[i];
+    }
+    CHECK(nfree == pmm_free_page_count(), "model %zu free, pmm %u", nfree, pmm_free_page_count());
+
+    // Rebuild the free run figures from the model
+    struct pmm_stats want = { 0 };
+    size_t run = 0;
+    for (size_t i = 0; i <= g_npages; i++) {
+        if (i < g_npages && g_model[i]) {
+            run++;
+            continue;
+        }
+        if (run != 0) {
+            unsigned k = 31u - (unsigned)__builtin_clz((uint32_t)run);
+            if (k >= PMM_RUN_BUCKETS) k = PMM_RUN_BUCKETS - 1;
+            want.run_hist[k]++;
+            want.free_runs++;
+            if (run > want.largest_free_run) want.largest_free_run = run;
+        }
+        run = 0;
+    }
+
+    struct pmm_stats st;
+    pmm_get_stats(&st);
+    CHECK(st.free_pages == nfree, "stats free %u", st.free_pages);
+    CHECK(st.free_pages <= st.total_pages, "%u free of %u pages", st.free_pages, st.total_pages);
+    CHECK(st.used_pages + st.free_pages == st.total_pages, "used+free != total");
+    CHECK(st.free_runs == want.free_runs, "runs %u, want %u", st.free_runs, want.free_runs);
+    CHECK(st.largest_free_run == want.largest_free_run, "largest %u, want %u",
+        st.largest_free_run, want.largest_free_run);
+    CHECK(memcmp(st.run_hist, want.run_hist, sizeof(want.run_hist)) == 0, "histogram differs");
+}
+
+/* --- PMM: single pages and blocks --- */
+
+typedef struct {
+    phys_bytes pa;
+    unsigned order;
+} held_t;
+
+#define MAX_HELD 512
+
+// Every page of a held block carries its own address at both ends
+static void stamp_block(phys_bytes pa, unsigned order)
+{
+    for (size_t i = 0; i < ((size_t)1 << order); i++) {
+        const phys_bytes page = pa + (phys_bytes)(i * PAGE_SIZE);
+        uint32_t *w = pa_ptr(page);
+        w[0] = page;
+        w[PAGE_SIZE / 4 - 1] = ~page;
+    }
+}
+
+static void check_stamp(phys_bytes pa, unsigned order)
+{
+    for (size_t i = 0; i < ((size_t)1 << order); i++) {
+        const phys_bytes page = pa + (phys_bytes)(i * PAGE_SIZE);
+        const uint32_t *w = pa_ptr(page);
+        CHECK(w[0] == page && w[PAGE_SIZE / 4 - 1] == ~page, "page %08x overwritten", page);
+    }
+}
+
+// Is there any naturally aligned run of 2^order free pages in the model?
+static bool model_has_block(unsigned order)
+{
+    const size_t n = (size_t)1 << order;
+    for (size_t i = 0; i + n <= g_npages; i += n) {
+        size_t j = 0;
+        while (j < n && g_model[i + j]) j++;
+        if (j == n) return true;
+    }
+    return false;
+}
+
+static void model_take(phys_bytes pa, unsigned order)
+{
+    for (size_t i = 0; i < ((size_t)1 << order); i++) {
+        const size_t idx = model_idx(pa) + i;
+        CHECK(idx < g_npages && g_model[idx], "pa %08x handed out twice", model_pa(idx));
+        g_model[idx] = 0;
+    }
+}
+
+static void model_give(phys_bytes pa, unsigned order)
+{
+    for (size_t i = 0; i < ((size_t)1 << order); i++) {
+        g_model[model_idx(pa) + i] = 1;
+    }
+}
+
+static void test_pmm_pages(void)
+{
+    setup_two_chunks();
+    const phys_pages start_free = pmm_free_page_count();
+
+    static held_t held[MAX_HELD];
+    size_t nheld = 0;
+
+    for (int it = 0; it < 20000; it++) {
+        const uint32_t op = rng_below(100);
+
+        if (op < 50 && nheld < MAX_HELD) {
+            // Mostly single pages, some blocks, a few up to the largest
+            const unsigned order = (rng_below(5) == 0) ? 1 + rng_below(rng_below(4) ? 6 : PMM_MAX_ORDER) : 0;
+            const phys_bytes pa = order ? pmm_alloc_pages(order) : pmm_alloc_page();
+            if (pa == PMM_INVALID_PA) {
+                CHECK(!model_has_block(order), "order %u failed with a free block", order);
+                continue;
+            }
+            CHECK((pa & ((PAGE_SIZE << order) - 1)) == 0, "pa %08x misaligned for order %u", pa, order);
+            CHECK(in_ranges(pa), "pa %08x outside memory", pa);
+            model_take(pa, order);
+
+            const struct pmm_page *pg = pmm_page(pa);
+            CHECK(pg->refcount == 1 && pg->type == PMM_PAGE_KERNEL, "bad descriptor for %08x", pa);
+
+            stamp_block(pa, order);
+            held[nheld++] = (held_t){ pa, order };
+        } else if (op < 90 && nheld != 0) {
+            const size_t k = rng_below(nheld);
+            const held_t h = held[k];
+            held[k] = held[--nheld];
+
+            check_stamp(h.pa, h.order);
+            if (h.order) {
+                pmm_free_pages(h.pa, h.order);
+            } else {
+                pmm_free_page(h.pa);
+            }
+            model_give(h.pa, h.order);
+            CHECK(pmm_page(h.pa)->type == PMM_PAGE_FREE, "freed page not marked free");
+        } else if (nheld != 0) {
+            // Share a page, then drop the extra reference
+            const held_t h = held[rng_below(nheld)];
+            if (h.order != 0) continue;
+
+            pmm_page_ref(h.pa);
+            CHECK(pmm_page(h.pa)->refcount == 2, "ref didn't count");
+            CHECK(!pmm_page_unref(h.pa), "page freed with a reference left");
+            CHECK(pmm_page(h.pa)->refcount == 1, "unref didn't count");
+        }
+
+        if ((it & 127) == 0) {
+            check_against_model();
+        }
+    }
+
+    // The last reference frees the page
+    while (nheld != 0) {
+        const held_t h = held[--nheld];
+        check_stamp(h.pa, h.order);
+        if (h.order) {
+            pmm_free_pages(h.pa, h.order);
+        } else {
+            CHECK(pmm_page_unref(h.pa), "last unref didn't free");
+        }
+        model_give(h.pa, h.order);
+    }
+    check_against_model();
+    CHECK(pmm_free_page_count() == start_free, "leaked pages");
+}
+
+/* --- PMM: reserve/release of arbitrary ranges --- */
+
+static void test_pmm_ranges(void)
+{
+    setup_two_chunks();
+
+    for (int it = 0; it < 4000; it++) {
+        // Mostly inside the chunks, sometimes anywhere in the arena, holes
+        // included
+        phys_bytes base, size;
+        if (rng_below(4) != 0) {
+            const struct mem_range *r = &g_ranges[rng_below(2)];
+            const phys_bytes off  = rng_below(r->size);
+            size = rng_below(256 * PAGE_SIZE);
+            if (size > r->size - off) size = r->size - off;
+            base = r->addr + off;
+        } else {
+            base = arena_base + rng_below(ARENA_SIZE);
+            size = rng_below(ARENA_SIZE - (base - arena_base));
+        }
+
+        if (rng() & 1) {
+            pmm_release_range(base, size);
+            // Only pages entirely inside the range are freed, and only RAM
+            const phys_bytes s = (base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            const phys_bytes e = (base + size) & ~(PAGE_SIZE - 1);
+            for (phys_bytes pa = s; pa < e; pa += PAGE_SIZE) {
+                if (in_ranges(pa)) g_model[model_idx(pa)] = 1;
+            }
+        } else {
+            pmm_reserve_range(base, size);
+            // Every page the range touches is reserved
+            const phys_bytes s = base & ~(PAGE_SIZE - 1);
+            const phys_bytes e = (base + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            for (phys_bytes pa = s; pa < e; pa += PAGE_SIZE) g_model[model_idx(pa)] = 0;
+        }
+
+        if ((it & 31) == 0) {
+            check_against_model();
+        }
+    }
+    check_against_model();
+}
+
+// The range holding `pa`, or -1
+static int range_of(phys_bytes pa)
+{
+    for (int i = 0; i < 2; i++) {
+        if (pa >= g_ranges[i].addr && pa - g_ranges[i].addr < g_ranges[i].size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// RAM far apart only needs metadata for the RAM. The far chunk isn't backed
+// by the arena, the PMM never touches the pages it hands out.
+static void test_pmm_sparse(void)
+{
+    arena_init(ARENA_SIZE, ARENA_ALIGN);
+    const phys_bytes far = 0xF0000000u;
+    CHECK(arena_base + ARENA_SIZE <= far, "arena at %08x", arena_base);
+
+    // Metadata for the whole span would be megabytes, more than head.S maps
+    init_mapped_size = 1u << 20;
+    g_ranges[0] = (struct mem_range){ arena_base, 0x200000 };
+    g_ranges[1] = (struct mem_range){ far + 3 * PAGE_SIZE, 0x400000 };
+    boot_mm(g_ranges, 2);
+
+    struct pmm_stats st;
+    pmm_get_stats(&st);
+    CHECK(st.total_pages == 0x600000 / PAGE_SIZE, "%u pages of RAM", st.total_pages);
+    const phys_pages start_free = pmm_free_page_count();
+    CHECK(pmm_page(far) == NULL && pmm_page(far - 0x10000000u) == NULL, "hole has descriptors");
+    CHECK(pmm_page(far + 3 * PAGE_SIZE) != NULL, "far chunk has no descriptors");
+
+    // Every page once, all of them RAM
+    static phys_bytes got[0x600000 / PAGE_SIZE];
+    size_t n = 0;
+    for (phys_bytes pa; (pa = pmm_alloc_page()) != PMM_INVALID_PA; ) {
+        CHECK(n < ARRAY_LEN(got) && range_of(pa) >= 0, "page %08x outside memory", pa);
+        CHECK(pmm_page(pa)->type == PMM_PAGE_KERNEL, "bad descriptor for %08x", pa);
+        got[n++] = pa;
+    }
+    CHECK(n == start_free, "%zu pages handed out", n);
+    for (size_t i = 0; i < n; i++) {
+        pmm_free_page(got[i]);
+    }
+
+    // Blocks are aligned and stay in one chunk
+    for (unsigned order = 1; order <= PMM_MAX_ORDER; order++) {
+        held_t held[64];
+        size_t nheld = 0;
+        phys_bytes pa;
+        while (nheld < ARRAY_LEN(held) && (pa = pmm_alloc_pages(order)) != PMM_INVALID_PA) {
+            const phys_bytes last = pa + (PAGE_SIZE << order) - 1;
+            CHECK((pa & ((PAGE_SIZE << order) - 1)) == 0, "pa %08x misaligned for order %u", pa, order);
+            CHECK(range_of(pa) >= 0 && range_of(pa) == range_of(last),
+                "order %u block %08x-%08x leaves its chunk", order, pa, last);
+            held[nheld++] = (held_t){ pa, order };
+        }
+        while (nheld != 0) {
+            pmm_free_pages(held[--nheld].pa, order);
+        }
+    }
+    CHECK(pmm_free_page_count() == start_free, "leaked pages");
+}
+
+/* --- zero pool --- */
+
+static void test_zero_pool(void)
+{
+    setup_two_chunks();
+    const phys_pages start_free = pmm_free_page_count();
+
+    // Leave something to clear up behind a freed page
+    phys_bytes dirty = pmm_alloc_page();
+    memset(pa_ptr(dirty), 0xA5, PAGE_SIZE);
+    pmm_free_page(dirty);
+
+    size_t refilled = 0;
+    while (pmm_refill_zero_pool()) refilled++;
+    CHECK(refilled == CONFIG_ZERO_POOL_PAGES, "pool took %zu pages", refilled);
+    CHECK(pmm_free_page_count() == start_free - refilled, "pool pages not counted as used");
+
+    // Pool pages and then freshly cleared ones
+    phys_bytes got[CONFIG_ZERO_POOL_PAGES + 4];
+    for (size_t i = 0; i < ARRAY_LEN(got); i++) {
+        got[i] = pmm_alloc_zeroed_page();
+        CHECK(got[i] != PMM_INVALID_PA, "zeroed alloc failed");
+        CHECK(pmm_page(got[i])->type == PMM_PAGE_KERNEL, "zero page still typed as pool");
+
+        const uint8_t *p = pa_ptr(got[i]);
+        for (size_t j = 0; j < PAGE_SIZE; j++) {
+            CHECK(p[j] == 0, "page %08x not zeroed at %zu", got[i], j);
+        }
+        memset(pa_ptr(got[i]), 0x5A, PAGE_SIZE);
+    }
+    for (size_t i = 0; i < ARRAY_LEN(got); i++) {
+        pmm_free_page(got[i]);
+    }
+    CHECK(pmm_free_page_count() == start_free, "leaked pages");
+}
+
+/* --- page table pool --- */
+
+typedef struct {
+    phys_bytes pa;
+    size_t size;
+    uint8_t tag;
+} table_t;
+
+#define MAX_TABLES 400
+
+static void test_pt_pool(void)
+{
+    setup_two_chunks();
+
+    static table_t held[MAX_TABLES];
+    size_t nheld = 0;
+
+    for (int it = 0; it < 20000; it++) {
+        if (nheld < MAX_TABLES && (nheld == 0 || rng_below(100) < 52)) {
+            const bool big = rng() & 1;
+            const phys_bytes pa = big ? pt_alloc_ptr_table_phys() : pt_alloc_page_table_phys();
+            const size_t size = big ? RPTABLE_SIZE : PGTABLE_SIZE;
+
+            CHECK((pa & (size - 1)) == 0, "table %08x misaligned", pa);
+            CHECK(pmm_page(pa)->type == PMM_PAGE_PT_POOL, "table %08x not in a pool page", pa);
+
+            uint8_t *p = pa_ptr(pa);
+            for (size_t j = 0; j < size; j++) {
+                CHECK(p[j] == 0, "table %08x not cleared", pa);
+            }
+
+            // Overlapping tables would clobber each other's tag
+            const uint8_t tag = (uint8_t)(1 + rng_below(255));
+            memset(p, tag, size);
+            held[nheld++] = (table_t){ pa, size, tag };
+        } else {
+            const size_t k = rng_below(nheld);
+            const table_t t = held[k];
+            held[k] = held[--nheld];
+
+            const uint8_t *p = pa_ptr(t.pa);
+            for (size_t j = 0; j < t.size; j++) {
+                CHECK(p[j] == t.tag, "table %08x overwritten", t.pa);
+            }
+            if (t.size == RPTABLE_SIZE) {
+                pt_free_ptr_table_phys(t.pa);
+            } else {
+                pt_free_page_table_phys(t.pa);
+            }
+        }
+    }
+}
+
+// Many address spaces' worth of tables, created and destroyed a few times
+static void test_pt_pool_churn(void)
+{
+    setup_two_chunks();
+    const phys_pages start_free = pmm_free_page_count();
+
+    enum { NTABLES = 3000 };
+    static table_t held[NTABLES];
+
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < NTABLES; i++) {
+            const bool big = (i % 4) == 0;
+            held[i] = (table_t){
+                big ? pt_alloc_ptr_table_phys() : pt_alloc_page_table_phys(),
+                big ? RPTABLE_SIZE : PGTABLE_SIZE, 0
+            };
+        }
+        CHECK(start_free - pmm_free_page_count() > 64, "only %u pool pages in use",
+            start_free - pmm_free_page_count());
+
+        for (size_t i = NTABLES; i > 1; i--) {
+            const size_t k = rng_below(i);
+            const table_t t = held[k];
+            held[k] = held[i - 1];
+            held[i - 1] = t;
+        }
+        for (size_t i = 0; i < NTABLES; i++) {
+            if (held[i].size == RPTABLE_SIZE) {
+                pt_free_ptr_table_phys(held[i].pa);
+            } else {
+                pt_free_page_table_phys(held[i].pa);
+            }
+        }
+
+        // Once trimmed, only the kept empty pages stay, plus the node slabs
+        // their nodes happen to live in
+        while (pt_pool_trim()) {}
+        const phys_pages kept = start_free - pmm_free_page_count();
+        CHECK(kept <= 2 * 2 * CONFIG_PT_POOL_EMPTY_PAGES, "%u pages kept after round %d", kept, round);
+    }
+}
+
+static void pt_double_free(void)
+{
+    setup_two_chunks();
+    const phys_bytes pa = pt_alloc_page_table_phys();
+    pt_free_page_table_phys(pa);
+    pt_free_page_table_phys(pa);
+}
+
+static void pt_free_wrong_size(void)
+{
+    setup_two_chunks();
+    pt_free_ptr_table_phys(pt_alloc_page_table_phys());
+}
+
+static void pt_free_foreign(void)
+{
+    setup_two_chunks();
+    pt_free_page_table_phys(pmm_alloc_page());
+}
+
+static void test_pt_pool_misuse(void)
+{
+    CHECK(expect_trap(pt_double_free), "double free not caught");
+    CHECK(expect_trap(pt_free_wrong_size), "free with the wrong size not caught");
+    CHECK(expect_trap(pt_free_foreign), "free of a non-pool page not caught");
+}
+
+/* --- page tables --- */
+
+// The leaf descriptor for `va`, read straight from the tables. 0 if any
+// level is missing.
+static uint32_t vm_pte(const vm_space_t *vm, virt_bytes va)
+{
+    const uint32_t *root = pa_ptr(vm->root_pa);
+    const uint32_t rd = root[ROOT_INDEX(va)];
+    if (!desc_is_table(rd)) return 0;
+
+    const uint32_t *ptr = pa_ptr(rd & RPTABLE_ADDR_MASK);
+    const uint32_t pd = ptr[PTR_INDEX(va)];
+    if (!desc_is_table(pd)) return 0;
+
+    const uint32_t *page = pa_ptr(pd & PGTABLE_ADDR_MASK);
+    return page[PAGE_INDEX(va)];
+}
+
+// Every table's used bits match its non-zero entries
+static void check_used_table(const uint32_t *t, uint32_t entries, const char *what)
+{
+    const uint32_t *used = pt_table_used_map((phys_bytes)(uintptr_t)t);
+    for (uint32_t i = 0; i < entries; i++) {
+        const bool bit = (used[i / 32] >> (31 - i % 32)) & 1;
+        CHECK(bit == (t[i] != 0), "%s entry %u: used bit %u, descriptor %08x", what, i, bit, t[i]);
+    }
+}
+
+static void check_used(const vm_space_t *vm)
+{
+    const uint32_t *root = pa_ptr(vm->root_pa);
+    check_used_table(root, ROOT_ENTRIES, "root");
+    for (uint32_t ri = 0; ri < ROOT_ENTRIES; ri++) {
+        if (!desc_is_table(root[ri])) continue;
+        const uint32_t *ptr = pa_ptr(root[ri] & RPTABLE_ADDR_MASK);
+        check_used_table(ptr, PTR_ENTRIES, "pointer");
+        for (uint32_t pi = 0; pi < PTR_ENTRIES; pi++) {
+            if (!desc_is_table(ptr[pi])) continue;
+            check_used_table(pa_ptr(ptr[pi] & PGTABLE_ADDR_MASK), PAGE_ENTRIES, "page");
+        }
+    }
+}
+
+#define VM_BASE     0x10000000u
+#define VM_PAGES    ((64u << 20) / PAGE_SIZE)
+
+static void test_vm_map_range(void)
+{
+    setup_two_chunks();
+    const phys_pages start_free = pmm_free_page_count();
+
+    static phys_bytes model[VM_PAGES];   // expected pa + 1, 0 if unmapped
+    memset(model, 0, sizeof(model));
+
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+
+    for (int it = 0; it < 400; it++) {
+        const uint32_t first = rng_below(VM_PAGES);
+        uint32_t n = 1 + rng_below(300);
+        if (n > VM_PAGES - first) n = VM_PAGES - first;
+
+        bool clash = false;
+        for (uint32_t i = 0; i < n; i++) clash |= model[first + i] != 0;
+        if (clash) continue;
+
+        // The tables don't care what the frames are, any aligned pa will do
+        const phys_bytes pa = rng() & PAGE_ADDR_MASK & 0x7FFFFFFFu;
+        const virt_bytes va = VM_BASE + first * PAGE_SIZE;
+        const size_t len = (size_t)n * PAGE_SIZE - rng_below(PAGE_SIZE);
+        if (n == 1 && rng_below(2)) {
+            vm_space_map_page(&vm, va, pa, USER_PTE_FLAGS);
+        } else {
+            vm_space_map_range(&vm, va, pa, len, USER_PTE_FLAGS);
+        }
+        for (uint32_t i = 0; i < n; i++) model[first + i] = pa + i * PAGE_SIZE + 1;
+    }
+
+    for (uint32_t i = 0; i < VM_PAGES; i++) {
+        const virt_bytes va = VM_BASE + i * PAGE_SIZE;
+        const uint32_t pte = vm_pte(&vm, va);
+        if (model[i] == 0) {
+            CHECK(pte == 0, "%08x mapped to %08x", va, pte);
+        } else {
+            CHECK(pte == mk_page_desc(model[i] - 1, USER_PTE_FLAGS),
+                "%08x maps %08x, want %08x", va, pte, model[i] - 1);
+        }
+    }
+
+    check_used(&vm);
+
+    // Tearing it down gives every table back
+    vm_space_destroy(&vm);
+    while (pt_pool_trim()) {}
+    const phys_pages kept = start_free - pmm_free_page_count();
+    CHECK(kept <= 2 * 2 * CONFIG_PT_POOL_EMPTY_PAGES, "%u pages kept after destroy", kept);
+}
+
+static void vm_map_twice(void)
+{
+    setup_two_chunks();
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+    vm_space_map_range(&vm, VM_BASE, 0x100000, 16 * PAGE_SIZE, USER_PTE_FLAGS);
+    vm_space_map_range(&vm, VM_BASE + 15 * PAGE_SIZE, 0x200000, PAGE_SIZE, USER_PTE_FLAGS);
+}
+
+static void vm_map_misaligned(void)
+{
+    setup_two_chunks();
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+    vm_space_map_range(&vm, VM_BASE + 0x800, 0x100000, PAGE_SIZE, USER_PTE_FLAGS);
+}
+
+static void vm_map_wrap(void)
+{
+    setup_two_chunks();
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+    vm_space_map_range(&vm, 0xFFFFE000u, 0x100000, 4 * PAGE_SIZE, USER_PTE_FLAGS);
+}
+
+static void test_vm_misuse(void)
+{
+    CHECK(expect_trap(vm_map_twice), "mapping over a mapped page not caught");
+    CHECK(expect_trap(vm_map_misaligned), "misaligned va not caught");
+    CHECK(expect_trap(vm_map_wrap), "range wrapping around not caught");
+}
+
+// Regions fault in zeroed pages, once, and only where they allow the access
+static void test_vm_fault(void)
+{
+    setup_two_chunks();
+    const phys_pages start_free = pmm_free_page_count();
+
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+    vm_space_activate(&vm);
+    const virt_bytes rw = VM_BASE, ro = VM_BASE + 64 * PAGE_SIZE;
+    CHECK(vm_space_add_anon(&vm, rw, 32 * PAGE_SIZE - 1, USER_PTE_FLAGS), "rw region");
+    CHECK(vm_space_add_anon(&vm, ro, 8 * PAGE_SIZE, USER_RO_FLAGS), "ro region");
+    CHECK(!vm_space_add_anon(&vm, ro - PAGE_SIZE, 2 * PAGE_SIZE, USER_PTE_FLAGS), "overlap accepted");
+    CHECK(!vm_space_add_anon(&vm, 0xFFFFF000u & PAGE_ADDR_MASK, 2 * PAGE_SIZE, USER_PTE_FLAGS),
+        "wrapping region accepted");
+    CHECK(!vm_space_add_anon(&vm, VM_BASE + 128 * PAGE_SIZE, 0, USER_PTE_FLAGS), "empty region accepted");
+
+    // Outside any region, and writes to the read-only one, stay faults
+    CHECK(!vm_space_fault(&vm, rw + 32 * PAGE_SIZE, false), "fault past the rw region");
+    CHECK(!vm_space_fault(&vm, ro + 3 * PAGE_SIZE, true), "write to the ro region");
+    CHECK(vm_pte(&vm, ro + 3 * PAGE_SIZE) == 0, "refused fault mapped a page");
+
+    static bool touched[32];
+    memset(touched, 0, sizeof(touched));
+    for (int it = 0; it < 200; it++) {
+        const uint32_t i = rng_below(32);
+        const virt_bytes va = rw + i * PAGE_SIZE + rng_below(PAGE_SIZE);
+        const phys_pages before = pmm_free_page_count();
+        const uint32_t old = vm_pte(&vm, va);
+        CHECK(vm_space_fault(&vm, va, rng_below(2)), "fault at %08x refused", va);
+
+        const uint32_t pte = vm_pte(&vm, va);
+        CHECK(desc_is_page(pte) && (pte & ~PAGE_ADDR_MASK) == mk_page_desc(0, USER_PTE_FLAGS),
+            "%08x maps %08x", va, pte);
+        const phys_bytes pa = pte & PAGE_ADDR_MASK;
+        if (touched[i]) {
+            CHECK(pte == old, "page at %08x replaced", va);
+            CHECK(pmm_free_page_count() == before, "second fault allocated");
+        } else {
+            CHECK(pmm_page(pa)->type == PMM_PAGE_USER_ANON, "type %u", pmm_page(pa)->type);
+            const uint8_t *p = pa_ptr(pa);
+            for (size_t b = 0; b < PAGE_SIZE; b++) CHECK(p[b] == 0, "page at %08x not zeroed", va);
+            memset(pa_ptr(pa), 0xA5, PAGE_SIZE);
+            touched[i] = true;
+        }
+        CHECK(host_mmu.last_va == (va & PAGE_ADDR_MASK),
+            "flushed %08x for %08x", host_mmu.last_va, va);
+    }
+    CHECK(vm_space_fault(&vm, ro, false), "read of the ro region refused");
+    CHECK(vm_pte(&vm, ro) == mk_page_desc(vm_pte(&vm, ro) & PAGE_ADDR_MASK, USER_RO_FLAGS),
+        "ro page maps %08x", vm_pte(&vm, ro));
+
+    // Pages mapped by hand aren't the space's to free
+    const phys_bytes own = pmm_alloc_page();
+    vm_space_map_page(&vm, VM_BASE + 256 * PAGE_SIZE, own, USER_PTE_FLAGS);
+
+    vm_space_destroy(&vm);
+    CHECK(pmm_page(own)->refcount == 1, "hand-mapped page released");
+    pmm_free_page(own);
+    while (pt_pool_trim()) {}
+    const phys_pages kept = start_free - pmm_free_page_count();
+    CHECK(kept <= 2 * 2 * CONFIG_PT_POOL_EMPTY_PAGES, "%u pages kept after destroy", kept);
+}
+
+// Running out of memory in a fault leaves no table behind
+static void test_vm_fault_oom(void)
+{
+    setup_two_chunks();
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+    CHECK(vm_space_add_anon(&vm, VM_BASE, 4 * PAGE_SIZE, USER_PTE_FLAGS), "region");
+
+    // Take every page, the zero pool's included
+    static phys_bytes held[ARENA_SIZE / PAGE_SIZE];
+    size_t nheld = 0;
+    for (phys_bytes pa; (pa = pmm_alloc_zeroed_page()) != PMM_INVALID_PA; ) {
+        CHECK(nheld < ARRAY_LEN(held), "more pages than the arena");
+        held[nheld++] = pa;
+    }
+
+    CHECK(!vm_space_fault(&vm, VM_BASE, true), "fault without memory");
+    const uint32_t *root = pa_ptr(vm.root_pa);
+    CHECK(!desc_is_table(root[ROOT_INDEX(VM_BASE)]), "failed fault left a pointer table");
+    check_used(&vm);
+
+    // The frame and the pool pages for two tables
+    for (int i = 0; i < 3; i++) {
+        pmm_free_page(held[--nheld]);
+    }
+    CHECK(vm_space_fault(&vm, VM_BASE, true), "fault after pages were freed");
+    CHECK(desc_is_page(vm_pte(&vm, VM_BASE)), "page not mapped");
+    check_used(&vm);
+
+    vm_space_destroy(&vm);
+    while (nheld != 0) {
+        pmm_free_page(held[--nheld]);
+    }
+}
+
+static void check_regions(const vm_space_t *vm)
+{
+    for (uint16_t i = 0; i < vm->nregions; i++) {
+        const struct vm_region *r = &vm->regions[i];
+        CHECK(r->start < r->end, "region %u empty", i);
+        if (i != 0) {
+            CHECK(vm->regions[i - 1].end <= r->start, "regions %u and %u out of order", i - 1, i);
+        }
+    }
+}
+
+// Region lookups against a per-page model, and physical regions that are
+// split up
+#define RG_PAGES    512u
+
+static void test_vm_regions(void)
+{
+    setup_two_chunks();
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+
+    static uint8_t kind[RG_PAGES];      // 0 none, 1 anon, 2 phys
+    static phys_bytes phys[RG_PAGES];
+    memset(kind, 0, sizeof(kind));
+
+    unsigned added = 0;
+    for (int it = 0; it < 200; it++) {
+        const uint32_t first = rng_below(RG_PAGES);
+        uint32_t n = 1 + rng_below(24);
+        if (n > RG_PAGES - first) n = RG_PAGES - first;
+        const virt_bytes va = VM_BASE + first * PAGE_SIZE;
+        const bool is_phys = rng_below(2);
+        const phys_bytes pa = (0x00100000u + rng_below(0x1000) * PAGE_SIZE);
+
+        bool clash = false;
+        for (uint32_t i = 0; i < n; i++) clash |= kind[first + i] != 0;
+        const bool ok = is_phys
+            ? vm_space_add_phys(&vm, va, pa, n * PAGE_SIZE, USER_RO_FLAGS)
+            : vm_space_add_anon(&vm, va, n * PAGE_SIZE, USER_PTE_FLAGS);
+        CHECK(ok == (!clash && added < CONFIG_VM_SPACE_REGIONS), "add of %u pages at page %u: %d", n, first, ok);
+        check_regions(&vm);
+        if (ok) {
+            added++;
+            for (uint32_t i = 0; i < n; i++) {
+                kind[first + i] = is_phys ? 2 : 1;
+                phys[first + i] = pa + i * PAGE_SIZE;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < RG_PAGES; i++) {
+        const virt_bytes va = VM_BASE + i * PAGE_SIZE;
+        CHECK(vm_space_fault(&vm, va, false) == (kind[i] != 0), "fault at page %u", i);
+        if (kind[i] == 2) {
+            CHECK(vm_pte(&vm, va) == mk_page_desc(phys[i], USER_RO_FLAGS), "page %u maps %08x", i, vm_pte(&vm, va));
+        } else if (kind[i] == 1) {
+            CHECK(pmm_page(vm_pte(&vm, va) & PAGE_ADDR_MASK)->type == PMM_PAGE_USER_ANON, "page %u", i);
+        }
+    }
+    vm_space_destroy(&vm);
+
+    // Splitting a physical region keeps every page on its frame
+    const phys_bytes pa = 0x00200000u;
+    vm_space_init_user(&vm);
+    CHECK(vm_space_add_phys(&vm, VM_BASE, pa, 8 * PAGE_SIZE, USER_PTE_FLAGS), "phys region");
+    CHECK(vm_space_protect_range(&vm, VM_BASE + 3 * PAGE_SIZE, 2 * PAGE_SIZE, USER_RO_FLAGS), "protect");
+    CHECK(vm.nregions == 3, "%u regions after split", vm.nregions);
+    check_regions(&vm);
+    for (uint32_t i = 0; i < 8; i++) {
+        const uint32_t flags = (i == 3 || i == 4) ? USER_RO_FLAGS : USER_PTE_FLAGS;
+        CHECK(vm_space_fault(&vm, VM_BASE + i * PAGE_SIZE, false), "fault");
+        CHECK(vm_pte(&vm, VM_BASE + i * PAGE_SIZE) == mk_page_desc(pa + i * PAGE_SIZE, flags),
+            "page %u maps %08x", i, vm_pte(&vm, VM_BASE + i * PAGE_SIZE));
+    }
+    CHECK(!vm_space_fault(&vm, VM_BASE + 4 * PAGE_SIZE, true), "write to the ro part");
+    CHECK(vm_space_unmap_range(&vm, VM_BASE + 2 * PAGE_SIZE, 4 * PAGE_SIZE), "unmap");
+    CHECK(vm.nregions == 2 && vm.regions[0].end == VM_BASE + 2 * PAGE_SIZE
+        && vm.regions[1].start == VM_BASE + 6 * PAGE_SIZE
+        && vm.regions[1].pa == pa + 6 * PAGE_SIZE, "regions after unmap");
+    CHECK(!vm_space_fault(&vm, VM_BASE + 3 * PAGE_SIZE, false), "fault in the hole");
+}
+
+// Random faults, unmaps, protects and new regions, checked against a model
+// of which pages are mapped and what each region allows
+#define UM_PAGES    300u
+
+static void test_vm_unmap(void)
+{
+    setup_two_chunks();
+    const phys_pages start_free = pmm_free_page_count();
+
+    vm_space_t vm;
+    vm_space_init_user(&vm);
+    vm_space_activate(&vm);
+
+    static uint32_t region[UM_PAGES];   // region pte_flags + 1, 0 outside regions
+    static bool mapped[UM_PAGES];
+    memset(region, 0, sizeof(region));
+    memset(mapped, 0, sizeof(mapped));
+    // Straddle a page table and a pointer table boundary
+    const virt_bytes base = VM_BASE + (32u << 20) - 100 * PAGE_SIZE;
+
+    for (int it = 0; it < 3000; it++) {
+        const uint32_t first = rng_below(UM_PAGES);
+        uint32_t n = 1 + rng_below(rng_below(4) ? 8 : 150);
+        if (n > UM_PAGES - first) n = UM_PAGES - first;
+        const virt_bytes va = base + first * PAGE_SIZE;
+        const uint32_t flags = rng_below(2) ? USER_PTE_FLAGS : USER_RO_FLAGS;
+
+        switch (rng_below(5)) {
+        case 0: {
+            bool clash = false;
+            for (uint32_t i = 0; i < n; i++) clash |= region[first + i] != 0;
+            const bool ok = vm_space_add_anon(&vm, va, n * PAGE_SIZE, flags);
+            CHECK(!clash || !ok, "overlapping region accepted");
+            if (ok) for (uint32_t i = 0; i < n; i++) region[first + i] = flags + 1;
+            break;
+        }
+        case 1:
+        case 2:
+            for (uint32_t i = first; i < first + n; i++) {
+                const bool write = rng_below(2);
+                const bool allowed = region[i] != 0 && !(write && ((region[i] - 1) & PTE_RONLY));
+                CHECK(vm_space_fault(&vm, base + i * PAGE_SIZE, write) == allowed, "fault at page %u", i);
+                mapped[i] |= allowed;
+            }
+            break;
+        case 3: {
+            host_mmu = (struct host_mmu){ 0 };
+            uint32_t present = 0;
+            for (uint32_t i = 0; i < n; i++) present += mapped[first + i];
+            if (!vm_space_unmap_range(&vm, va, n * PAGE_SIZE)) break;
+            for (uint32_t i = 0; i < n; i++) region[first + i] = mapped[first + i] = 0;
+            if (present <= CONFIG_VM_FLUSH_PAGES_MAX) {
+                CHECK(host_mmu.flush_page == present && host_mmu.flush_user == 0,
+                    "unmapping %u pages: %u flushed, %u pflushan", present,
+                    host_mmu.flush_page, host_mmu.flush_user);
+            } else {
+                CHECK(host_mmu.flush_user != 0, "unmapping %u pages without pflushan", present);
+            }
+            break;
+        }
+        case 4:
+            if (!vm_space_protect_range(&vm, va, n * PAGE_SIZE, flags)) break;
+            for (uint32_t i = 0; i < n; i++) {
+                if (region[first + i]) region[first + i] = flags + 1;
+            }
+            break;
+        }
+        check_regions(&vm);
+        check_used(&vm);
+
+        for (uint32_t i = 0; i < UM_PAGES; i++) {
+            const uint32_t pte = vm_pte(&vm, base + i * PAGE_SIZE);
+            if (!mapped[i]) {
+                CHECK(!desc_is_page(pte), "page %u still maps %08x", i, pte);
+            } else {
+                const phys_bytes pa = pte & PAGE_ADDR_MASK;
+                CHECK(pte == mk_page_desc(pa, region[i] - 1), "page %u maps %08x, flags %08x",
+                    i, pte, region[i] - 1);
+                CHECK(pmm_page(pa)->refcount == 1 && pmm_page(pa)->type == PMM_PAGE_USER_ANON,
+                    "page %u frame refcount %u", i, pmm_page(pa)->refcount);
+            }
+        }
+    }
+
+    // Unmapping everything gives every frame and table back, the space is
+    // left with just its root table
+    vm_space_unmap_range(&vm, base, UM_PAGES * PAGE_SIZE);
+    CHECK(vm.nregions == 0, "%u regions left", vm.nregions);
+    const uint32_t *root = pa_ptr(vm.root_pa);
+    for (uint32_t i = 0; i < ROOT_ENTRIES; i++) CHECK(root[i] == 0, "root entry %u left", i);
+    vm_space_destroy(&vm);
+    while (pt_pool_trim()) {}
+    const phys_pages kept = start_free - pmm_free_page_count();
+    CHECK(kept <= 2 * 2 * CONFIG_PT_POOL_EMPTY_PAGES, "%u pages kept after unmapping", kept);
+}
+
+// Protecting shared pages keeps them copy-on-write
+static void test_vm_protect_cow(void)
+{
+    setup_two_chunks();
+    vm_space_t parent, child;
+    vm_space_init_user(&parent);
+    CHECK(vm_space_add_anon(&parent, VM_BASE, 4 * PAGE_SIZE, USER_RO_FLAGS), "region");
+    CHECK(vm_space_fault(&parent, VM_BASE, false), "fault");
+    vm_space_clone(&child, &parent);
+
+    CHECK(vm_space_protect_range(&child, VM_BASE, 4 * PAGE_SIZE, USER_PTE_FLAGS), "protect");
+    const phys_bytes pa = vm_pte(&parent, VM_BASE) & PAGE_ADDR_MASK;
+    CHECK(vm_pte(&child, VM_BASE) == mk_page_desc(pa, USER_PTE_FLAGS | PTE_RONLY),
+        "shared page made writable: %08x", vm_pte(&child, VM_BASE));
+    CHECK(vm_space_fault(&child, VM_BASE, true), "write fault after protect");
+    CHECK((vm_pte(&child, VM_BASE) & PAGE_ADDR_MASK) != pa, "no copy made");
+    CHECK(!vm_space_fault(&parent, VM_BASE, true), "parent's region still read-only");
+
+    // A protect that needs a region slot there isn't room for changes nothing
+    vm_space_t full;
+    vm_space_init_user(&full);
+    for (uint32_t i = 0; i < CONFIG_VM_SPACE_REGIONS; i++) {
+        CHECK(vm_space_add_anon(&full, VM_BASE + i * 4 * PAGE_SIZE, 4 * PAGE_SIZE, USER_PTE_FLAGS), "region");
+    }
+    CHECK(vm_space_fault(&full, VM_BASE + PAGE_SIZE, true), "fault");
+    const uint32_t pte = vm_pte(&full, VM_BASE + PAGE_SIZE);
+    CHECK(!vm_space_protect_range(&full, VM_BASE + PAGE_SIZE, PAGE_SIZE, USER_RO_FLAGS), "split without room");
+    CHECK(vm_pte(&full, VM_BASE + PAGE_SIZE) == pte, "failed protect changed the pte");
+    CHECK(vm_space_protect_range(&full, VM_BASE, 8 * PAGE_SIZE, USER_RO_FLAGS), "aligned protect");
+    CHECK(vm_pte(&full, VM_BASE + PAGE_SIZE) == (pte | PTE_RONLY) - PTE_DIRTY,
+        "protect gave %08x", vm_pte(&full, VM_BASE + PAGE_SIZE));
+
+    // Room for one split but not for the two an unmap inside a region needs
+    vm_space_t spare;
+    vm_space_init_user(&spare);
+    for (uint32_t i = 0; i < CONFIG_VM_SPACE_REGIONS - 1; i++) {
+        CHECK(vm_space_add_anon(&spare, VM_BASE + i * 4 * PAGE_SIZE, 4 * PAGE_SIZE, USER_PTE_FLAGS), "region");
+    }
+    CHECK(!vm_space_unmap_range(&spare, VM_BASE + PAGE_SIZE, PAGE_SIZE), "two splits in one slot");
+    CHECK(spare.nregions == CONFIG_VM_SPACE_REGIONS - 1, "%u regions after failed unmap", spare.nregions);
+    CHECK(spare.regions[0].start == VM_BASE && spare.regions[0].end == VM_BASE + 4 * PAGE_SIZE,
+        "failed unmap split %08lx-%08lx", spare.regions[0].start, spare.regions[0].end);
+    CHECK(vm_space_unmap_range(&spare, VM_BASE + PAGE_SIZE, 3 * PAGE_SIZE), "one split");
+    CHECK(spare.nregions == CONFIG_VM_SPACE_REGIONS - 1, "%u regions after unmap", spare.nregions);
+}
+
+// A clone shares every page until one side writes to it
+static void test_vm_clone(void)
+{
+    setup_two_chunks();
+    const phys_pages start_free = pmm_free_page_count();
+
+    vm_space_t parent, child;
+    vm_space_init_user(&parent);
+    vm_space_activate(&parent);
+    CHECK(vm_space_add_anon(&parent, VM_BASE, 64 * PAGE_SIZE, USER_PTE_FLAGS), "rw region");
+    CHECK(vm_space_add_anon(&parent, VM_BASE + 128 * PAGE_SIZE, 4 * PAGE_SIZE, USER_RO_FLAGS), "ro region");
+
+    enum { NPAGES = 40 };
+    static uint32_t idx[NPAGES];
+    for (uint32_t n = 0; n < NPAGES; n++) {
+        idx[n] = (n * 7u) % 64u;   // spread over the region, all distinct
+        const virt_bytes va = VM_BASE + idx[n] * PAGE_SIZE;
+        CHECK(vm_space_fault(&parent, va, true), "fault");
+        memset(pa_ptr(vm_pte(&parent, va) & PAGE_ADDR_MASK), (int)n + 1, PAGE_SIZE);
+    }
+    CHECK(vm_space_fault(&parent, VM_BASE + 128 * PAGE_SIZE, false), "ro fault");
+    const phys_bytes own = pmm_alloc_page();
+    vm_space_map_page(&parent, VM_BASE + 256 * PAGE_SIZE, own, USER_PTE_FLAGS);
+
+    host_mmu = (struct host_mmu){ 0 };
+    vm_space_clone(&child, &parent);
+    CHECK(host_mmu.flush_user + host_mmu.flush_page != 0, "parent's writable entries not flushed");
+    CHECK(child.nregions == parent.nregions, "regions not copied");
+    check_used(&parent);
+    check_used(&child);
+
+    for (uint32_t n = 0; n < NPAGES; n++) {
+        const virt_bytes va = VM_BASE + idx[n] * PAGE_SIZE;
+        const uint32_t p = vm_pte(&parent, va), c = vm_pte(&child, va);
+        CHECK(p == c && (p & PTE_RONLY), "%08x: parent %08x child %08x", va, p, c);
+        const struct pmm_page *pg = pmm_page(p & PAGE_ADDR_MASK);
+        CHECK(pg->refcount == 2 && (pg->flags & PMM_PAGE_F_COW), "%08x: refcount %u", va, pg->refcount);
+    }
+    CHECK(vm_pte(&child, VM_BASE + 256 * PAGE_SIZE) == vm_pte(&parent, VM_BASE + 256 * PAGE_SIZE)
+        && pmm_page(own)->refcount == 1, "hand-mapped page not shared as is");
+    CHECK(!vm_space_fault(&child, VM_BASE + 128 * PAGE_SIZE, true), "write to a shared ro page");
+
+    // The child writes first and gets a copy, the parent then owns the original
+    for (uint32_t n = 0; n < NPAGES; n++) {
+        const virt_bytes va = VM_BASE + idx[n] * PAGE_SIZE;
+        const phys_bytes orig = vm_pte(&parent, va) & PAGE_ADDR_MASK;
+        vm_space_t *first = (n & 1) ? &child : &parent;
+        vm_space_t *second = (n & 1) ? &parent : &child;
+
+        CHECK(vm_space_fault(first, va, true), "cow fault refused");
+        const uint32_t f = vm_pte(first, va);
+        const phys_bytes copy = f & PAGE_ADDR_MASK;
+        CHECK(copy != orig && !(f & PTE_RONLY), "%08x: first writer maps %08x", va, f);
+        CHECK(f == mk_page_desc(copy, USER_PTE_FLAGS), "%08x: first writer maps %08x", va, f);
+        const uint8_t *b = pa_ptr(copy);
+        for (size_t i = 0; i < PAGE_SIZE; i++) CHECK(b[i] == n + 1, "%08x: copy differs at %zu", va, i);
+        CHECK(pmm_page(orig)->refcount == 1, "original refcount %u", pmm_page(orig)->refcount);
+
+        CHECK(vm_space_fault(second, va, true), "last holder's fault refused");
+        CHECK(vm_pte(second, va) == mk_page_desc(orig, USER_PTE_FLAGS), "%08x: last holder maps %08x",
+            va, vm_pte(second, va));
+        CHECK(!(pmm_page(orig)->flags & PMM_PAGE_F_COW), "cow flag left on");
+    }
+
+    vm_space_destroy(&child);
+    vm_space_destroy(&parent);
+    CHECK(pmm_page(own)->refcount == 1, "hand-mapped page released");
+    pmm_free_page(own);
+    while (pt_pool_trim()) {}
+    const phys_pages kept = start_free - pmm_free_page_count();
+    CHECK(kept <= 2 * 2 * CONFIG_PT_POOL_EMPTY_PAGES, "%u pages kept after destroy", kept);
+}
+
+// Which flushes reach the MMU, and that nothing flushes more than it has to
+static void test_vm_flush(void)
+{
+    setup_two_chunks();
+    vm_space_t kern, a, b;
+    vm_space_init_kernel(&kern);
+    vm_space_init_user(&a);
+    vm_space_init_user(&b);
+
+    vm_space_activate(&kern);
+    CHECK(host_mmu.srp == kern.root_pa && host_mmu.flush_all == 1 && host_mmu.cache_push == 1,
+        "kernel switch: srp %08x, %u pflusha, %u pushes", host_mmu.srp,
+        host_mmu.flush_all, host_mmu.cache_push);
+
+    // Context switches keep the kernel's global entries
+    vm_space_activate(&a);
+    vm_space_activate(&a);
+    vm_space_activate(&b);
+    CHECK(host_mmu.urp == b.root_pa && host_mmu.flush_user == 2 && host_mmu.flush_all == 1,
+        "user switches: %u pflushan, %u pflusha", host_mmu.flush_user, host_mmu.flush_all);
+    CHECK(host_mmu.cache_push == 1, "user switch pushed the data cache");
+
+    // `a` is switched out, it has nothing to flush
+    host_mmu = (struct host_mmu){ 0 };
+    vm_flush_page(&a, VM_BASE);
+    vm_flush_range(&a, VM_BASE, 1u << 20);
+    CHECK(host_mmu.flush_page == 0 && host_mmu.flush_user == 0, "flushed a switched out space");
+
+    vm_flush_page(&b, VM_BASE + 0x123);
+    CHECK(host_mmu.flush_page == 1 && host_mmu.last_va == VM_BASE && !host_mmu.last_supervisor,
+        "page flush hit %08x", host_mmu.last_va);
+    vm_flush_page(&kern, KERNEL_VIRT_BASE);
+    CHECK(host_mmu.flush_page == 2 && host_mmu.last_supervisor, "kernel page flushed as user");
+
+    // Short ranges page by page, counting partial pages at both ends
+    host_mmu = (struct host_mmu){ 0 };
+    vm_flush_range(&b, VM_BASE + PAGE_SIZE - 1, PAGE_SIZE + 2);
+    CHECK(host_mmu.flush_page == 3, "%u pages flushed for a 3 page range", host_mmu.flush_page);
+    for (uint32_t n = 1; n <= CONFIG_VM_FLUSH_PAGES_MAX + 1; n++) {
+        host_mmu = (struct host_mmu){ 0 };
+        vm_flush_range(&b, VM_BASE, n * PAGE_SIZE);
+        if (n <= CONFIG_VM_FLUSH_PAGES_MAX) {
+            CHECK(host_mmu.flush_page == n && host_mmu.flush_user == 0,
+                "%u pages: %u flushed", n, host_mmu.flush_page);
+        } else {
+            CHECK(host_mmu.flush_page == 0 && host_mmu.flush_user == 1,
+                "%u pages: %u flushed, %u pflushan", n, host_mmu.flush_page, host_mmu.flush_user);
+        }
+    }
+    host_mmu = (struct host_mmu){ 0 };
+    vm_flush_range(&kern, KERNEL_VIRT_BASE, 16u << 20);
+    CHECK(host_mmu.flush_all == 1 && host_mmu.flush_user == 0, "big kernel range");
+
+    // Batches flush nothing until they finish, then at most once per page
+    vm_flush_batch_t batch;
+    for (uint32_t n = 0; n <= CONFIG_VM_FLUSH_PAGES_MAX + 1; n++) {
+        host_mmu = (struct host_mmu){ 0 };
+        vm_flush_batch_init(&batch, &b);
+        for (uint32_t i = 0; i < n; i++) vm_flush_batch_add(&batch, VM_BASE + i * PAGE_SIZE);
+        CHECK(host_mmu.flush_page == 0 && host_mmu.flush_user == 0, "batch flushed early");
+        vm_flush_batch_finish(&batch);
+        if (n <= CONFIG_VM_FLUSH_PAGES_MAX) {
+            CHECK(host_mmu.flush_page == n && host_mmu.flush_user == 0,
+                "batch of %u: %u flushed", n, host_mmu.flush_page);
+        } else {
+            CHECK(host_mmu.flush_page == 0 && host_mmu.flush_user == 1,
+                "batch of %u: %u flushed, %u pflushan", n, host_mmu.flush_page, host_mmu.flush_user);
+        }
+    }
+
+    // Destroying the installed space takes its entries with it, once
+    host_mmu = (struct host_mmu){ 0 };
+    vm_space_destroy(&a);
+    vm_space_destroy(&b);
+    CHECK(host_mmu.flush_user == 1, "%u pflushan for destroying two spaces", host_mmu.flush_user);
+    vm_space_init_user(&a);
+    vm_space_activate(&a);
+    CHECK(host_mmu.urp == a.root_pa && host_mmu.flush_user == 2, "reactivating after destroy");
+}
+
+// Where `va`'s descriptors live: root, pointer and page table entry
+static void vm_slots(const vm_space_t *vm, virt_bytes va, const uint32_t *slot[3])
+{
+    const uint32_t *root = pa_ptr(vm->root_pa);
+    const uint32_t *ptr = pa_ptr(root[ROOT_INDEX(va)] & RPTABLE_ADDR_MASK);
+    const uint32_t *page = pa_ptr(ptr[PTR_INDEX(va)] & PGTABLE_ADDR_MASK);
+    slot[0] = &root[ROOT_INDEX(va)];
+    slot[1] = &ptr[PTR_INDEX(va)];
+    slot[2] = &page[PAGE_INDEX(va)];
+}
+
+// Did a data cache push since the last reset cover `pa`?
+static bool cache_pushed(phys_bytes pa)
+{
+    CHECK(host_mmu.ncache_ops <= HOST_CACHE_OPS, "%u cache ops, too many to check", host_mmu.ncache_ops);
+    if (host_mmu.cache_push != 0) return true;
+    for (unsigned i = 0; i < host_mmu.ncache_ops; i++) {
+        const char op = host_mmu.cache_ops[i].op;
+        phys_bytes lo = host_mmu.cache_ops[i].pa;
+        phys_bytes hi = lo + host_mmu.cache_ops[i].len;
+        const phys_bytes unit = op == 'P' ? 4096 : 16;
+        if (op != 'p' && op != 'P') continue;
+        lo &= ~(unit - 1);
+        hi = (hi + unit - 1) & ~(unit - 1);
+        if (pa >= lo && pa < hi) return true;
+    }
+    return false;
+}
+
+static bool pushed(const uint32_t *slot)
+{
+    return cache_pushed((phys_bytes)(uintptr_t)slot);
+}
+
+// With copy-back caching, every descriptor written is pushed for the
+// table walk to see
+static void test_vm_table_push(void)
+{
+    if (!CONFIG_CACHE_COPYBACK) return;
+
+    setup_two_chunks();
+    vm_space_t vm, child;
+    vm_space_init_user(&vm);
+    vm_space_activate(&vm);
+    CHECK(vm_space_add_anon(&vm, VM_BASE, 64 * PAGE_SIZE, USER_PTE_FLAGS), "region");
+    const uint32_t *slot[3];
+
+    host_mmu = (struct host_mmu){ 0 };
+    CHECK(vm_space_fault(&vm, VM_BASE + 5 * PAGE_SIZE, true), "fault");
+    vm_slots(&vm, VM_BASE + 5 * PAGE_SIZE, slot);
+    for (int l = 0; l < 3; l++) CHECK(pushed(slot[l]), "fault: level %d not pushed", l);
+
+    // The second half needs a new pointer table and page table
+    host_mmu = (struct host_mmu){ 0 };
+    const virt_bytes mva = VM_BASE + (32u << 20) - 10 * PAGE_SIZE;
+    vm_space_map_range(&vm, mva, 0x00100000u, 20 * PAGE_SIZE, USER_PTE_FLAGS);
+    for (uint32_t i = 0; i < 20; i++) {
+        vm_slots(&vm, mva + i * PAGE_SIZE, slot);
+        for (int l = i < 10 ? 1 : 0; l < 3; l++) CHECK(pushed(slot[l]), "map page %u: level %d not pushed", i, l);
+    }
+
+    host_mmu = (struct host_mmu){ 0 };
+    CHECK(vm_space_protect_range(&vm, mva, 20 * PAGE_SIZE, USER_RO_FLAGS), "protect");
+    for (uint32_t i = 0; i < 20; i++) {
+        vm_slots(&vm, mva + i * PAGE_SIZE, slot);
+        CHECK(pushed(slot[2]), "protect page %u not pushed", i);
+    }
+
+    // Clearing the last entry of a table clears the entries above it too
+    vm_slots(&vm, mva + 15 * PAGE_SIZE, slot);
+    host_mmu = (struct host_mmu){ 0 };
+    CHECK(vm_space_unmap_range(&vm, mva + 10 * PAGE_SIZE, 10 * PAGE_SIZE), "unmap");
+    for (int l = 0; l < 3; l++) CHECK(pushed(slot[l]), "unmap: level %d not pushed", l);
+
+    host_mmu = (struct host_mmu){ 0 };
+    vm_space_clone(&child, &vm);
+    vm_slots(&vm, VM_BASE + 5 * PAGE_SIZE, slot);
+    CHECK(pushed(slot[2]), "parent's shared entry not pushed");
+    vm_slots(&child, VM_BASE + 5 * PAGE_SIZE, slot);
+    for (int l = 0; l < 3; l++) CHECK(pushed(slot[l]), "clone: level %d not pushed", l);
+}
+
+// Both lookups agree with the tables, and only the installed space asks the MMU
+static void test_vm_lookup(void)
+{
+    setup_two_chunks();
+    vm_space_t a, b;
+    vm_space_init_user(&a);
+    vm_space_init_user(&b);
+    vm_space_activate(&a);
+
+    enum { LK_PAGES = 512 };
+    for (uint32_t i = 0; i < LK_PAGES; i++) {
+        if (rng_below(3) == 0) continue;
+        const phys_bytes pa = rng() & PAGE_ADDR_MASK & 0x7FFFFFFFu;
+        const uint32_t flags = rng_below(2) ? USER_PTE_FLAGS : USER_RO_FLAGS;
+        vm_space_map_page(&a, VM_BASE + i * PAGE_SIZE, pa, flags);
+        vm_space_map_page(&b, VM_BASE + i * PAGE_SIZE, pa, flags);
+    }
+
+    for (int it = 0; it < 4000; it++) {
+        // Mostly around the mappings, sometimes where no table exists
+        const virt_bytes va = rng_below(4) ? VM_BASE + rng_below(LK_PAGES * PAGE_SIZE) : rng();
+        const uint32_t pte = vm_pte(&a, va);
+
+        phys_bytes pa = 0;
+        uint32_t flags = 0;
+        const bool found = vm_space_lookup(&a, va, &pa, &flags);
+        CHECK(found == (desc_is_page(pte) != 0), "%08x: lookup %u, pte %08x", va, found, pte);
+        if (found) {
+            CHECK(pa == (pte & PAGE_ADDR_MASK) + (va & ~PAGE_ADDR_MASK) && flags == (pte & PTE_ATTR_MASK),
+                "%08x: lookup %08x/%08x, pte %08x", va, pa, flags, pte);
+        }
+
+        host_mmu.ptest = 0;
+        phys_bytes mpa = 0;
+        uint32_t mflags = 0;
+        CHECK(vm_space_lookup_mmu(&a, va, &mpa, &mflags) == found, "%08x: PTESTR disagrees", va);
+        CHECK(mpa == pa && mflags == flags, "%08x: PTESTR %08x/%08x, walk %08x/%08x", va, mpa, mflags, pa, flags);
+        CHECK(host_mmu.ptest == 1, "installed space not looked up with PTESTR");
+
+        CHECK(vm_space_lookup_mmu(&b, va, &mpa, &mflags) == found, "%08x: switched out space", va);
+        CHECK(host_mmu.ptest == 1, "switched out space looked up with PTESTR");
+    }
+    CHECK(vm_space_lookup(&a, VM_BASE, NULL, NULL) == (vm_pte(&a, VM_BASE) != 0), "lookup without results");
+}
+
+/* --- cache maintenance --- */
+
+#define CW_BASE     0x00100000u
+#define CW_LINES    2048u           // 32 KiB window
+
+// Which lines of the window the recorded operations touched, by kind
+static void cache_touched(uint8_t *pushes, uint8_t *invals, uint8_t *syncs)
+{
+    memset(pushes, 0, CW_LINES);
+    memset(invals, 0, CW_LINES);
+    memset(syncs, 0, CW_LINES);
+    CHECK(host_mmu.ncache_ops <= HOST_CACHE_OPS, "%u cache ops", host_mmu.ncache_ops);
+    for (unsigned i = 0; i < host_mmu.ncache_ops; i++) {
+        const char op = host_mmu.cache_ops[i].op;
+        const phys_bytes unit = (op == 'P' || op == 'I' || op == 'S') ? 4096 : 16;
+        const phys_bytes lo = host_mmu.cache_ops[i].pa & ~(unit - 1);
+        const phys_bytes hi = (host_mmu.cache_ops[i].pa + host_mmu.cache_ops[i].len + unit - 1) & ~(unit - 1);
+        uint8_t *map = (op == 'p' || op == 'P') ? pushes : (op == 'i' || op == 'I') ? invals : syncs;
+        for (phys_bytes a = lo; a < hi; a += 16) {
+            CHECK(a >= CW_BASE && a < CW_BASE + CW_LINES * 16, "op '%c' at %08x left the window", op, a);
+            map[(a - CW_BASE) / 16] = 1;
+        }
+    }
+}
+
+// Ranges pick line, page or whole-cache operations and cover what they must
+static void test_cache_range(void)
+{
+    static uint8_t pushes[CW_LINES], invals[CW_LINES], syncs[CW_LINES];
+
+    for (int it = 0; it < 3000; it++) {
+        const uint32_t span = rng_below(3) == 0 ? 64 : rng_below(2) ? 2048 : 16384;
+        const phys_bytes pa = CW_BASE + 4096 + rng_below(8192);
+        const size_t len = rng_below(span);
+        const phys_bytes end = pa + len;
+        const uint32_t lines = (end + 15) / 16 - pa / 16;
+        const uint32_t pages = (end + 4095) / 4096 - pa / 4096;
+        const char want = lines <= CONFIG_CACHE_LINES_MAX ? 'l' : pages <= CONFIG_CACHE_PAGES_MAX ? 'p' : 'a';
+
+        // Flush and sync: every line of the range, by the right kind of op
+        for (int sync = 0; sync < 2; sync++) {
+            host_mmu = (struct host_mmu){ 0 };
+            if (sync) icache_sync_range(pa, len); else cache_flush_range(pa, len);
+            const unsigned all = sync ? host_mmu.cache_sync : host_mmu.cache_push;
+            cache_touched(pushes, invals, syncs);
+            const uint8_t *done = sync ? syncs : pushes;
+            if (len == 0) {
+                CHECK(host_mmu.ncache_ops == 0 && all == 0, "empty range did something");
+                continue;
+            }
+            CHECK((want == 'a') == (all == 1), "%08x+%zu: whole cache %u, want %c", pa, len, all, want);
+            for (unsigned i = 0; i < host_mmu.ncache_ops; i++) {
+                const char op = host_mmu.cache_ops[i].op;
+                CHECK(op == (want == 'l' ? "ps"[sync] : "PS"[sync]), "%08x+%zu: op '%c', want %c",
+                    pa, len, op, want);
+            }
+            if (want != 'a') {
+                for (phys_bytes a = pa & ~15u; a < end; a += 16) {
+                    CHECK(done[(a - CW_BASE) / 16], "%08x+%zu: line %08x missed", pa, len, a);
+                }
+            }
+        }
+
+        // Invalidate: whole lines inside dropped, partial ones written back,
+        // nothing outside dropped
+        host_mmu = (struct host_mmu){ 0 };
+        cache_inval_range(pa, len);
+        cache_touched(pushes, invals, syncs);
+        for (uint32_t i = 0; i < CW_LINES; i++) {
+            const phys_bytes a = CW_BASE + i * 16;
+            const bool inside = a >= pa && a + 16 <= end;
+            const bool partial = len != 0 && !inside && a < end && a + 16 > pa;
+            CHECK(!invals[i] || inside, "%08x+%zu: line %08x dropped", pa, len, a);
+            if (host_mmu.cache_push == 0) {
+                CHECK(!inside || invals[i], "%08x+%zu: line %08x kept", pa, len, a);
+            }
+            CHECK(!partial || pushes[i] || host_mmu.cache_push, "%08x+%zu: partial line %08x lost", pa, len, a);
+        }
+    }
+}
+
+/* --- transparent translation window --- */
+
+static uint64_t ref_coverage(const struct mem_range *r, unsigned n, uint64_t base, uint64_t size)
+{
+    uint64_t covered = 0;
+    for (unsigned i = 0; i < n; i++) {
+        const uint64_t lo = r[i].addr > base ? r[i].addr : base;
+        const uint64_t end = (uint64_t)r[i].addr + r[i].size;
+        const uint64_t hi = end < base + size ? end : base + size;
+        if (hi > lo) covered += hi - lo;
+    }
+    return covered;
+}
+
+static void test_tt_coverage(void)
+{
+    // A chunk wholly below the window covers none of it
+    const struct mem_range below[] = { { 0x00100000u, 0x00F00000u } };
+    CHECK(tt_coverage(below, 1, 0x01000000u, 0x01000000u) == 0, "chunk below the window counted");
+
+    // Straddling both ends, and a window that ends at 4GiB
+    const struct mem_range mixed[] = {
+        { 0x00800000u, 0x01000000u },   // half in
+        { 0x01C00000u, 0x00800000u },   // quarter in
+        { 0x03000000u, 0x00100000u },   // above
+    };
+    CHECK(tt_coverage(mixed, 3, 0x01000000u, 0x01000000u) == 0x00C00000u, "straddling chunks");
+    const struct mem_range top[] = { { 0xF0000000u, 0x10000000u }, { 0x10000000u, 0x01000000u } };
+    CHECK(tt_coverage(top, 2, 0x80000000u, 0x80000000u) == 0x10000000u, "window ending at 4GiB");
+
+    for (int it = 0; it < 20000; it++) {
+        struct mem_range r[4];
+        const unsigned n = 1 + rng_below(4);
+        for (unsigned i = 0; i < n; i++) {
+            r[i].addr = rng() & 0xFFFF0000u;
+            const uint32_t room = r[i].addr ? (uint32_t)(0x100000000ull - r[i].addr) : 0xFFFFFFFFu;
+            r[i].size = rng_below(2) ? rng_below(room) : rng_below(room < 0x04000000u ? room : 0x04000000u);
+        }
+        const unsigned shift = 24 + rng_below(6);   // four chunks can't overflow the sum
+        const uint32_t size = 1u << shift;
+        const uint32_t base = rng() & ~(size - 1);
+        const uint64_t want = ref_coverage(r, n, base, size);
+        CHECK(tt_coverage(r, n, base, size) == want, "window %08x+%08x: %08x, want %08llx",
+            base, size, tt_coverage(r, n, base, size), (unsigned long long)want);
+    }
+}
+
+// vm_init() clips RAM chunks and the kernel image to the window with this
+static void test_tt_overlap(void)
+{
+    // A kernel image wholly below the window isn't in it
+    phys_bytes start = 0x12345678u;
+    CHECK(tt_overlap(0x00400000u, 0x00200000u, 0x01000000u, 0x01000000u, &start) == 0, "image below the window");
+    CHECK(start == 0x12345678u, "start changed to %08x", start);
+
+    // A chunk ending at 4GiB in a window ending there too, and one reaching
+    // into the window from below
+    CHECK(tt_overlap(0xF0000000u, 0x10000000u, 0x80000000u, 0x80000000u, &start) == 0x10000000u
+        && start == 0xF0000000u, "chunk at the top: start %08x", start);
+    CHECK(tt_overlap(0x7F000000u, 0x02000000u, 0x80000000u, 0x80000000u, &start) == 0x01000000u
+        && start == 0x80000000u, "chunk into the top window: start %08x", start);
+    CHECK(tt_overlap(0x00000000u, 0x10000000u, 0x80000000u, 0x80000000u, &start) == 0, "chunk below a top window");
+
+    for (int it = 0; it < 20000; it++) {
+        const uint32_t addr = rng() & 0xFFFF0000u;
+        const uint32_t room = addr ? (uint32_t)(0x100000000ull - addr) : 0xFFFFFFFFu;
+        const uint32_t len = rng_below(2) ? rng_below(room) : rng_below(room < 0x04000000u ? room : 0x04000000u);
+        const uint32_t size = 1u << (24 + rng_below(8));
+        const uint32_t base = rng() & ~(size - 1);
+
+        const uint64_t lo = addr > base ? addr : base;
+        const uint64_t end = (uint64_t)addr + len;
+        const uint64_t hi = end < (uint64_t)base + size ? end : (uint64_t)base + size;
+        const uint64_t want = hi > lo ? hi - lo : 0;
+        const phys_bytes got = tt_overlap(addr, len, base, size, &start);
+        CHECK(got == want && (want == 0 || start == lo), "%08x+%08x in %08x+%08x: %08x at %08x, want %08llx at %08llx",
+            addr, len, base, size, got, start, (unsigned long long)want, (unsigned long long)lo);
+    }
+}
+
+/* --- early allocator --- */
+
+typedef struct {
+    phys_bytes base;
+    phys_bytes size;
+} range_t;
+
+typedef struct {
+    range_t r[1024];
+    size_t n;
+} range_set_t;
+
+static void collect_range(phys_bytes base, phys_bytes size, void *ctx)
+{
+    range_set_t *set = ctx;
+    CHECK(set->n < ARRAY_LEN(set->r), "too many ranges");
+    set->r[set->n++] = (range_t){ base, size };
+}
+
+// Sorted, and merged: no two entries overlap or touch
+static void check_list_shape(const range_set_t *set)
+{
+    for (size_t i = 0; i < set->n; i++) {
+        CHECK(set->r[i].size != 0, "empty region");
+        if (i != 0) {
+            CHECK(set->r[i - 1].base + set->r[i - 1].size < set->r[i].base,
+                "regions %zu and %zu not merged", i - 1, i);
+        }
+    }
+}
+
+// Where `policy` should put an allocation, worked out the slow way from
+// snapshots of the lists. 64-bit so nothing here can wrap.
+static bool ref_alloc(const range_set_t *mem, const range_set_t *res, ea_policy_t policy,
+                      uint64_t size, uint64_t align, uint64_t min_addr, uint64_t max_addr,
+                      phys_bytes *out)
+{
+    bool found = false;
+    uint64_t best = 0, best_gap = 0;
+    if (max_addr == 0) max_addr = 1ull << 32;
+
+    for (size_t m = 0; m < mem->n; m++) {
+        const uint64_t b = mem->r[m].base > min_addr ? mem->r[m].base : min_addr;
+        const uint64_t e = (uint64_t)mem->r[m].base + mem->r[m].size < max_addr
+            ? (uint64_t)mem->r[m].base + mem->r[m].size : max_addr;
+
+        uint64_t cursor = b;
+        for (size_t r = 0; r <= res->n && cursor < e; r++) {
+            uint64_t gap_end = e;
+            uint64_t next = e;
+            if (r < res->n) {
+                const uint64_t rb = res->r[r].base, re = rb + res->r[r].size;
+                if (re <= cursor) continue;
+                if (rb < gap_end) gap_end = rb > cursor ? rb : cursor;
+                next = re;
+            }
+            if (gap_end >= cursor + size) {
+                const uint64_t lo = (cursor + align - 1) & ~(align - 1);
+                const uint64_t hi = (gap_end - size) & ~(align - 1);
+                if (lo <= hi) {
+                    if (policy == EA_BOTTOM_UP && !found) {
+                        best = lo; found = true;
+                    } else if (policy == EA_TOP_DOWN) {
+                        best = hi; found = true;
+                    } else if (policy == EA_BEST_FIT && (!found || gap_end - cursor < best_gap)) {
+                        best = lo; best_gap = gap_end - cursor; found = true;
+                    }
+                }
+            }
+            cursor = next;
+        }
+    }
+    *out = (phys_bytes)best;
+    return found;
+}
+
+static void test_early_alloc_round(void)
+{
+    static const ea_policy_t policies[] = { EA_TOP_DOWN, EA_BOTTOM_UP, EA_BEST_FIT };
+    const ea_policy_t policy = policies[rng_below(3)];
+    ea_set_policy(policy);
+
+    // Memory between 16MiB and 2GiB, sizes from 1MiB to 16MiB
+    const unsigned nmem = 1 + rng_below(6);
+    for (unsigned i = 0; i < nmem; i++) {
+        ea_add_memory((1u + rng_below(127)) << 24 | (rng_below(256) << PAGE_SHIFT),
+                      (1u + rng_below(16)) << 20);
+    }
+    const unsigned nres = rng_below(16);
+    for (unsigned i = 0; i < nres; i++) {
+        ea_reserve(0x01000000u + rng_below(0x7F000000u), 1 + rng_below(0x40000));
+    }
+
+    for (unsigned i = 0; i < 24; i++) {
+        range_set_t mem = { 0 }, res = { 0 };
+        ea_for_each_memory(collect_range, &mem);
+        ea_for_each_reserved(collect_range, &res);
+        check_list_shape(&mem);
+        check_list_shape(&res);
+
+        const phys_bytes size  = 1 + rng_below(0x10000);
+        const phys_bytes align = 1u << rng_below(17);
+
+        // Half of the requests limited to a window
+        phys_bytes min_addr = 0, max_addr = 0;
+        if (rng() & 1) {
+            min_addr = rng_below(0x80000000u);
+            max_addr = min_addr + 1 + rng_below(0x20000000u);
+        }
+
+        phys_bytes want;
+        if (!ref_alloc(&mem, &res, policy, size, align, min_addr, max_addr, &want)) {
+            continue;   // would panic, and rightly so
+        }
+        const phys_bytes pa = ea_alloc_or_panic(size, align, min_addr, max_addr);
+        CHECK(pa == want, "policy %d put %08x+%08x at %08x, want %08x",
+            policy, size, align, pa, want);
+
+        CHECK((pa & (align - 1)) == 0, "%08x not aligned to %08x", pa, align);
+        CHECK(pa >= min_addr && (max_addr == 0 || pa + size <= max_addr), "%08x outside window", pa);
+
+        bool inside = false;
+        for (size_t j = 0; j < mem.n; j++) {
+            if (pa >= mem.r[j].base && pa + size <= mem.r[j].base + mem.r[j].size) {
+                inside = true;
+            }
+        }
+        CHECK(inside, "%08x+%08x not inside memory", pa, size);
+
+        for (size_t j = 0; j < res.n; j++) {
+            CHECK(pa + size <= res.r[j].base || pa >= res.r[j].base + res.r[j].size,
+                "%08x+%08x overlaps reserved %08x+%08x", pa, size, res.r[j].base, res.r[j].size);
+        }
+    }
+}
+
+static void test_early_alloc(void)
+{
+    // Fresh allocator state for every round
+    const uint32_t seed = rng_state;
+    for (uint32_t round = 0; round < 200; round++) {
+        rng_state = seed + round * 0x9E3779B9u;
+        if (rng_state == 0) rng_state = 1;
+        if (!run_forked("early_alloc round", test_early_alloc_round)) {
+            fprintf(stderr, "early_alloc round %u failed\n", round);
+            exit(1);
+        }
+    }
+}
+
+// Far more reservations than the static lists hold
+static void test_early_alloc_grow(void)
+{
+    arena_init(4u << 20, PAGE_SIZE);
+    ea_set_direct_map(arena_base, arena_size);
+    ea_add_memory(arena_base, arena_size);
+
+    // Every other page of the first half, in a scrambled order so inserts
+    // land all over the list
+    const unsigned n = 400;
+    for (unsigned i = 0; i < n; i++) {
+        const unsigned k = (i * 263u) % n;
+        ea_reserve(arena_base + 2 * k * PAGE_SIZE, PAGE_SIZE);
+    }
+
+    for (unsigned i = 0; i < 32; i++) {
+        (void)ea_alloc_or_panic(PAGE_SIZE, PAGE_SIZE, 0, 0);
+    }
+
+    // The grown lists are in the arena too, and reserved
+    static range_set_t all;
+    ea_for_each_reserved(collect_range, &all);
+    check_list_shape(&all);
+    for (unsigned k = 0; k < n; k++) {
+        const phys_bytes pa = arena_base + 2 * k * PAGE_SIZE;
+        bool have = false;
+        for (size_t i = 0; i < all.n; i++) {
+            if (pa >= all.r[i].base && pa + PAGE_SIZE <= all.r[i].base + all.r[i].size) have = true;
+        }
+        CHECK(have, "reservation %08x lost while growing", pa);
+    }
+}
+
+/* --- hand-off from the early allocator --- */
+
+static void ea_reserve_after_handoff(void)
+{
+    setup_two_chunks();
+    ea_reserve(arena_base, PAGE_SIZE);
+}
+
+static void ea_alloc_after_handoff(void)
+{
+    setup_two_chunks();
+    (void)ea_alloc_or_panic(PAGE_SIZE, PAGE_SIZE, 0, 0);
+}
+
+static void test_ea_handoff(void)
+{
+    setup_two_chunks();
+
+    // The stand-in kernel page was only ever reserved in the early allocator
+    CHECK(pmm_page(g_ranges[0].addr)->type == PMM_PAGE_KERNEL, "boot reservation lost");
+
+    // Everything the PMM has free is RAM, and the rest of the chunks is used
+    // only by the kernel page and the PMM's own metadata
+    struct pmm_stats st;
+    pmm_get_stats(&st);
+    const phys_pages ram = (g_ranges[0].size + g_ranges[1].size) / PAGE_SIZE;
+    CHECK(st.total_pages == ram, "total %u, want %u", st.total_pages, ram);
+    // Descriptors and bitmaps cover the whole span, holes included
+    const phys_pages span = (g_ranges[1].addr + g_ranges[1].size - arena_base) / PAGE_SIZE;
+    const phys_pages meta = (span * sizeof(struct pmm_page) + span / 4) / PAGE_SIZE + 2;
+    CHECK(st.used_pages >= 2 && st.used_pages <= 1 + meta, "%u pages used after boot", st.used_pages);
+
+    CHECK(expect_trap(ea_reserve_after_handoff), "ea_reserve works after hand-off");
+    CHECK(expect_trap(ea_alloc_after_handoff), "ea_alloc_or_panic works after hand-off");
+}
+
+/* --- driver --- */
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    { "pmm_pages",   test_pmm_pages },
+    { "pmm_ranges",  test_pmm_ranges },
+    { "pmm_sparse",  test_pmm_sparse },
+    { "zero_pool",   test_zero_pool },
+    { "pt_pool",     test_pt_pool },
+    { "pt_churn",    test_pt_pool_churn },
+    { "pt_misuse",   test_pt_pool_misuse },
+    { "vm_map",      test_vm_map_range },
+    { "vm_misuse",   test_vm_misuse },
+    { "vm_flush",    test_vm_flush },
+    { "vm_lookup",   test_vm_lookup },
+    { "vm_push",     test_vm_table_push },
+    { "cache_range", test_cache_range },
+    { "tt_coverage", test_tt_coverage },
+    { "tt_overlap", test_tt_overlap },
+    { "vm_fault",    test_vm_fault },
+    { "vm_oom",      test_vm_fault_oom },
+    { "vm_clone",    test_vm_clone },
+    { "vm_regions",  test_vm_regions },
+    { "vm_unmap",    test_vm_unmap },
+    { "vm_protect",  test_vm_protect_cow },
+    { "early_alloc", test_early_alloc },
+    { "ea_grow",     test_early_alloc_grow },
+    { "ea_handoff",  test_ea_handoff },
+};
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) rng_state = (uint32_t)strtoul(argv[1], NULL, 0);
+    if (rng_state == 0) rng_state = 1;
+    host_verbose = getenv("HOSTTEST_VERBOSE") != NULL;
+
+    printf("seed 0x%08x, %u KiB pages\n", rng_state, PAGE_SIZE / 1024);
+
+    int failed = 0;
+    for (size_t i = 0; i < ARRAY_LEN(tests); i++) {
+        const bool ok = run_forked(tests[i].name, tests[i].fn);
+        printf("%s %s\n", ok ? "PASS" : "FAIL", tests[i].name);
+        failed += !ok;
+    }
+    return failed ? 1 : 0;
+}